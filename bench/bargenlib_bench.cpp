@@ -0,0 +1,196 @@
+// Benchmarks bargenlib for every encoding and file type and prints the
+// results as JSON, so they can be diffed between releases.
+//
+//     bargenlib_bench [--iterations N] [--threads N] [--dir PATH] [--trace FILE]
+//
+// For each encoding and file type, N images are rendered one at a time and the
+// latency of each phase (rasterize, encode, write) is measured. A mixed batch
+// is then rendered with 1 thread and with the given number of threads.
+// Images are written to PATH (default: the current directory) under a small
+// set of reused names. With --trace, the multi-threaded batch is traced into
+// FILE as Chrome Trace Event JSON (needs bargenlib built with
+// -DBARGENLIB_INSTRUMENT).
+
+#include "bargenlib/bargenlib.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    const bargenlib::Encoding Encodings[] = {bargenlib::EAN_8, bargenlib::EAN_13, bargenlib::UPC_A};
+    const char *EncodingNames[] = {"EAN_13", "UPC_A", "EAN_8"};
+    const bargenlib::FileType FileTypes[] = {bargenlib::BMP, bargenlib::PNG, bargenlib::PNG_A};
+    const char *FileTypeNames[] = {"BMP", "PNG", "PNG_A"};
+
+    // Number of distinct file names reused per thread, so runs don't fill the disk.
+    const int FileSlots = 16;
+
+    struct Options {
+        int iterations = 1000;
+        int threads = static_cast<int>(std::thread::hardware_concurrency());
+        std::string dir = ".";
+        std::string trace;
+    };
+
+    double elapsedUs(Clock::time_point start, Clock::time_point end) {
+        return std::chrono::duration<double, std::micro>(end - start).count();
+    }
+
+    // Codes without check digit, which the library computes.
+    std::vector<int> randomCode(bargenlib::Encoding codeType, std::mt19937 &rng) {
+        std::size_t size = (codeType == bargenlib::EAN_8) ? 7 : (codeType == bargenlib::EAN_13) ? 12 : 11;
+        std::vector<int> code(size);
+        for (int &digit : code) digit = static_cast<int>(rng() % 10);
+        return code;
+    }
+
+    std::string imagePath(const Options &options, int thread, int index, bargenlib::FileType fileType) {
+        return options.dir + "/bargenlib_bench_" + std::to_string(thread) + "_"
+                + std::to_string(index % FileSlots) + (fileType == bargenlib::BMP ? ".bmp" : ".png");
+    }
+
+    double percentile(std::vector<double> sorted, double fraction) {
+        std::sort(sorted.begin(), sorted.end());
+        std::size_t index = static_cast<std::size_t>(fraction * (sorted.size() - 1) + 0.5);
+        return sorted[index];
+    }
+
+    void printPhase(const char *name, const std::vector<double> &latencies, bool last) {
+        double sum = 0;
+        for (double latency : latencies) sum += latency;
+        std::printf("        \"%s\": {\"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f}%s\n",
+                name, sum / latencies.size(), percentile(latencies, 0.5), percentile(latencies, 0.99),
+                last ? "" : ",");
+    }
+
+    void benchmarkCase(const Options &options, bargenlib::Encoding codeType, bargenlib::FileType fileType,
+            bool last) {
+        std::mt19937 rng(12345);
+        std::vector<double> rasterize, encode, write, total;
+        std::size_t bytes = 0;
+        for (int i = 0; i < options.iterations; i++) {
+            std::vector<int> code = randomCode(codeType, rng);
+            Clock::time_point t0 = Clock::now();
+            bargenlib::Raster raster = bargenlib::rasterize(code, codeType, fileType);
+            Clock::time_point t1 = Clock::now();
+            std::vector<unsigned char> file = bargenlib::encode(raster);
+            Clock::time_point t2 = Clock::now();
+            std::FILE *out = std::fopen(imagePath(options, 0, i, fileType).c_str(), "wb");
+            if (out) {
+                std::fwrite(file.data(), 1, file.size(), out);
+                std::fclose(out);
+            }
+            Clock::time_point t3 = Clock::now();
+            rasterize.push_back(elapsedUs(t0, t1));
+            encode.push_back(elapsedUs(t1, t2));
+            write.push_back(elapsedUs(t2, t3));
+            total.push_back(elapsedUs(t0, t3));
+            bytes += file.size();
+        }
+
+        double totalUs = 0;
+        for (double latency : total) totalUs += latency;
+        std::printf("    {\n");
+        std::printf("      \"encoding\": \"%s\",\n", EncodingNames[codeType]);
+        std::printf("      \"file_type\": \"%s\",\n", FileTypeNames[fileType]);
+        std::printf("      \"images\": %d,\n", options.iterations);
+        std::printf("      \"images_per_sec\": %.1f,\n", options.iterations / (totalUs / 1e6));
+        std::printf("      \"bytes_per_image\": %.1f,\n", static_cast<double>(bytes) / options.iterations);
+        std::printf("      \"phases\": {\n");
+        printPhase("rasterize", rasterize, false);
+        printPhase("encode", encode, false);
+        printPhase("write", write, false);
+        printPhase("total", total, true);
+        std::printf("      }\n");
+        std::printf("    }%s\n", last ? "" : ",");
+    }
+
+    // Renders a batch mixing every encoding and file type with save(), spread
+    // over the given number of threads, and returns the images per second.
+    double benchmarkBatch(const Options &options, int threads) {
+        const int images = options.iterations * 9;
+        std::atomic<int> next(0);
+        std::vector<std::thread> workers;
+        Clock::time_point start = Clock::now();
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&options, &next, images, t]() {
+                std::mt19937 rng(t + 1);
+                for (int i = next++; i < images; i = next++) {
+                    bargenlib::TraceSpan span("job");
+                    bargenlib::Encoding codeType = Encodings[i % 3];
+                    bargenlib::FileType fileType = FileTypes[(i / 3) % 3];
+                    bargenlib::save(randomCode(codeType, rng), imagePath(options, t, i, fileType),
+                            codeType, fileType);
+                }
+            });
+        }
+        for (std::thread &worker : workers) worker.join();
+        return images / (elapsedUs(start, Clock::now()) / 1e6);
+    }
+
+    Options parseOptions(int argc, char **argv) {
+        Options options;
+        for (int i = 1; i < argc; i++) {
+            bool hasValue = i + 1 < argc;
+            if (!std::strcmp(argv[i], "--iterations") && hasValue) {
+                options.iterations = std::atoi(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--threads") && hasValue) {
+                options.threads = std::atoi(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--dir") && hasValue) {
+                options.dir = argv[++i];
+            } else if (!std::strcmp(argv[i], "--trace") && hasValue) {
+                options.trace = argv[++i];
+            } else {
+                std::fprintf(stderr, "usage: %s [--iterations N] [--threads N] [--dir PATH] [--trace FILE]\n", argv[0]);
+                std::exit(1);
+            }
+        }
+        if (options.iterations < 1) options.iterations = 1;
+        if (options.threads < 1) options.threads = 1;
+        return options;
+    }
+}
+
+int main(int argc, char **argv) {
+    Options options = parseOptions(argc, argv);
+
+    std::printf("{\n");
+    std::printf("  \"iterations\": %d,\n", options.iterations);
+    std::printf("  \"cases\": [\n");
+    for (int e = 0; e < 3; e++) {
+        for (int f = 0; f < 3; f++) {
+            benchmarkCase(options, Encodings[e], FileTypes[f], e == 2 && f == 2);
+        }
+    }
+    std::printf("  ],\n");
+
+    double single = benchmarkBatch(options, 1);
+    bool tracing = !options.trace.empty() && bargenlib::startTrace();
+    if (!options.trace.empty() && !tracing) {
+        std::fprintf(stderr, "tracing needs bargenlib built with -DBARGENLIB_INSTRUMENT\n");
+    }
+    double multi = benchmarkBatch(options, options.threads);
+    if (tracing && !bargenlib::stopTrace(options.trace)) {
+        std::fprintf(stderr, "could not write %s\n", options.trace.c_str());
+    }
+    std::printf("  \"batch\": {\n");
+    std::printf("    \"images\": %d,\n", options.iterations * 9);
+    std::printf("    \"threads\": %d,\n", options.threads);
+    std::printf("    \"single_thread_images_per_sec\": %.1f,\n", single);
+    std::printf("    \"multi_thread_images_per_sec\": %.1f,\n", multi);
+    std::printf("    \"speedup\": %.2f\n", multi / single);
+    std::printf("  }\n");
+    std::printf("}\n");
+    return 0;
+}
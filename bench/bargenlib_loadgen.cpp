@@ -0,0 +1,223 @@
+// A load generator for tools/bargenlib_daemon.cpp: measures the request
+// throughput and latency of a running daemon and prints them as JSON.
+//
+//     bargenlib_loadgen [--socket PATH] [--connections N] [--depth N] [--requests N]
+//                       [--distinct N] [--file-type BMP|PNG|PNG_A] [--no-cache]
+//
+// Each connection has its own thread, which keeps --depth requests in flight
+// until it sent its share of --requests. Codes cycle over the three
+// encodings; with --distinct, they are drawn from that many codes, so the
+// daemon's render cache serves the repeats. Latency is measured from sending
+// a request to reading its reply.
+//
+//     g++ -O2 -Iinclude bench/bargenlib_loadgen.cpp -pthread -o bargenlib_loadgen
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    // The daemon's Encoding values in the order the requests cycle through them,
+    // and the digits each takes without the check digit.
+    const unsigned char Encodings[] = {2, 0, 1};  // EAN_8, EAN_13, UPC_A
+    const unsigned char CodeSizes[] = {7, 12, 11};
+    const char *FileTypeNames[] = {"BMP", "PNG", "PNG_A"};
+
+    struct Options {
+        std::string socket = "/tmp/bargenlib.sock";
+        int connections = 4;
+        int depth = 16;
+        long requests = 100000;
+        long distinct = 0;
+        unsigned char fileType = 1;
+        bool noCache = false;
+    };
+
+    struct Result {
+        std::vector<double> latencies;  // microseconds
+        long errors = 0;
+        std::uint64_t bytes = 0;
+        bool failed = false;
+    };
+
+    Options options;
+
+    void putU32(std::string &out, std::uint32_t value) {
+        for (int i = 0; i < 4; i++) out += static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+
+    std::uint32_t getU32(const char *p) {
+        const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+        return u[0] | (u[1] << 8) | (u[2] << 16) | (static_cast<std::uint32_t>(u[3]) << 24);
+    }
+
+    int connectTo(const std::string &path) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) return -1;
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    void appendRequest(std::string &out, std::uint32_t id, std::mt19937 &rng) {
+        int kind = id % 3;
+        std::uint32_t seed = options.distinct ? static_cast<std::uint32_t>(rng() % options.distinct) : rng();
+        std::mt19937 digits(seed);
+        putU32(out, 8u + CodeSizes[kind]);
+        putU32(out, id);
+        out += static_cast<char>(Encodings[kind]);
+        out += static_cast<char>(options.fileType);
+        out += static_cast<char>(options.noCache ? 1 : 0);
+        out += static_cast<char>(CodeSizes[kind]);
+        for (int i = 0; i < CodeSizes[kind]; i++) out += static_cast<char>(digits() % 10);
+    }
+
+    void run(long count, unsigned seed, Result &result) {
+        int fd = connectTo(options.socket);
+        if (fd < 0) {
+            result.failed = true;
+            return;
+        }
+        std::mt19937 rng(seed);
+        std::vector<Clock::time_point> sent(count);
+        std::string in, out;
+        char buffer[65536];
+        long next = 0, done = 0;
+        result.latencies.reserve(count);
+        while (done < count) {
+            out.clear();
+            while (next < count && next - done < options.depth) {
+                sent[next] = Clock::now();
+                appendRequest(out, static_cast<std::uint32_t>(next), rng);
+                next++;
+            }
+            for (std::size_t at = 0; at < out.size();) {
+                ssize_t n = send(fd, out.data() + at, out.size() - at, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    result.failed = true;
+                    close(fd);
+                    return;
+                }
+                at += static_cast<std::size_t>(n);
+            }
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                result.failed = true;
+                break;
+            }
+            in.append(buffer, n);
+            std::size_t at = 0;
+            while (in.size() - at >= 4 && in.size() - at - 4 >= getU32(&in[at])) {
+                std::uint32_t size = getU32(&in[at]);
+                std::uint32_t id = getU32(&in[at + 4]);
+                Clock::time_point now = Clock::now();
+                if (id < static_cast<std::uint32_t>(count)) {
+                    result.latencies.push_back(std::chrono::duration<double, std::micro>(now - sent[id]).count());
+                }
+                if (in[at + 8] != 0) result.errors++;
+                result.bytes += size - 5;
+                at += 4 + size;
+                done++;
+            }
+            in.erase(0, at);
+        }
+        close(fd);
+    }
+
+    double percentile(const std::vector<double> &sorted, double fraction) {
+        if (sorted.empty()) return 0;
+        return sorted[static_cast<std::size_t>(fraction * (sorted.size() - 1) + 0.5)];
+    }
+
+    void parseOptions(int argc, char **argv) {
+        for (int i = 1; i < argc; i++) {
+            bool hasValue = i + 1 < argc;
+            if (!std::strcmp(argv[i], "--socket") && hasValue) {
+                options.socket = argv[++i];
+            } else if (!std::strcmp(argv[i], "--connections") && hasValue) {
+                options.connections = std::atoi(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--depth") && hasValue) {
+                options.depth = std::atoi(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--requests") && hasValue) {
+                options.requests = std::atol(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--distinct") && hasValue) {
+                options.distinct = std::atol(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--file-type") && hasValue) {
+                const char *name = argv[++i];
+                options.fileType = !std::strcmp(name, "BMP") ? 0 : !std::strcmp(name, "PNG_A") ? 2 : 1;
+            } else if (!std::strcmp(argv[i], "--no-cache")) {
+                options.noCache = true;
+            } else {
+                std::fprintf(stderr, "usage: %s [--socket PATH] [--connections N] [--depth N] [--requests N] "
+                        "[--distinct N] [--file-type BMP|PNG|PNG_A] [--no-cache]\n", argv[0]);
+                std::exit(1);
+            }
+        }
+        if (options.connections < 1) options.connections = 1;
+        if (options.depth < 1) options.depth = 1;
+        if (options.requests < options.connections) options.requests = options.connections;
+        if (options.distinct < 0) options.distinct = 0;
+    }
+}
+
+int main(int argc, char **argv) {
+    parseOptions(argc, argv);
+    std::vector<Result> results(options.connections);
+    std::vector<std::thread> clients;
+    Clock::time_point start = Clock::now();
+    for (int c = 0; c < options.connections; c++) {
+        long count = options.requests / options.connections + (c < options.requests % options.connections);
+        clients.emplace_back(run, count, static_cast<unsigned>(c + 1), std::ref(results[c]));
+    }
+    for (std::thread &client : clients) client.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<double> latencies;
+    long errors = 0;
+    std::uint64_t bytes = 0;
+    for (const Result &result : results) {
+        if (result.failed) {
+            std::fprintf(stderr, "a connection to %s failed\n", options.socket.c_str());
+            return 1;
+        }
+        latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+        errors += result.errors;
+        bytes += result.bytes;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    std::printf("{\n");
+    std::printf("  \"connections\": %d,\n", options.connections);
+    std::printf("  \"depth\": %d,\n", options.depth);
+    std::printf("  \"file_type\": \"%s\",\n", FileTypeNames[options.fileType]);
+    std::printf("  \"distinct\": %ld,\n", options.distinct);
+    std::printf("  \"requests\": %zu,\n", latencies.size());
+    std::printf("  \"errors\": %ld,\n", errors);
+    std::printf("  \"requests_per_sec\": %.1f,\n", latencies.size() / seconds);
+    std::printf("  \"bytes_per_reply\": %.1f,\n", latencies.empty() ? 0.0 : static_cast<double>(bytes) / latencies.size());
+    std::printf("  \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}\n",
+            percentile(latencies, 0.5), percentile(latencies, 0.9), percentile(latencies, 0.99),
+            percentile(latencies, 0.999), latencies.empty() ? 0.0 : latencies.back());
+    std::printf("}\n");
+    return 0;
+}
@@ -0,0 +1,260 @@
+// Microbenchmarks for the hot kernels of lodepng: checksums, scanline
+// filters, LZ77, deflate, inflate and color conversion, over synthetic
+// barcode images and photo-like images. Results are printed as JSON.
+//
+//     lodepng_bench [--seed N] [--min-ms N]
+//
+// The inputs come from a seeded generator, so runs are reproducible and need
+// no image files. This file includes src/lodepng.cpp to reach its static
+// kernels, so it is compiled on its own, without lodepng.cpp:
+//
+//     g++ -O2 -Iinclude bench/lodepng_bench.cpp -pthread -o lodepng_bench
+
+#include "../src/lodepng.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        unsigned seed = 1;
+        double minMs = 200;
+    };
+
+    Options options;
+    bool firstResult = true;
+
+    // xorshift32, so the inputs don't depend on the standard library's generators.
+    struct Random {
+        unsigned state;
+        explicit Random(unsigned seed) : state(seed ? seed : 1) {}
+        unsigned next() {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        }
+    };
+
+    struct Image {
+        std::string name;
+        unsigned width;
+        unsigned height;
+        LodePNGColorType colorType;
+        unsigned channels;
+        std::vector<unsigned char> pixels;
+    };
+
+    // Greyscale EAN-like bars of 1-4 modules, scaled up and repeated on every row,
+    // like a barcode label rendered at print resolution.
+    Image barcodeImage(unsigned scale, Random &random) {
+        Image image;
+        image.name = "barcode_x" + std::to_string(scale);
+        image.width = 116 * scale;
+        image.height = 78 * scale;
+        image.colorType = LCT_GREY;
+        image.channels = 1;
+        std::vector<unsigned char> row(image.width, 255);
+        unsigned x = 9 * scale;
+        bool bar = true;
+        while (x < 104 * scale) {
+            unsigned width = (1 + random.next() % 4) * scale;
+            for (unsigned i = x; i < x + width && i < 104 * scale; i++) row[i] = bar ? 0 : 255;
+            x += width;
+            bar = !bar;
+        }
+        for (unsigned y = 0; y < image.height; y++) {
+            image.pixels.insert(image.pixels.end(), row.begin(), row.end());
+        }
+        return image;
+    }
+
+    // RGB gradients with soft blobs and a little noise, standing in for generic photos.
+    Image photoImage(unsigned width, unsigned height, Random &random) {
+        Image image;
+        image.name = "photo_" + std::to_string(width) + "x" + std::to_string(height);
+        image.width = width;
+        image.height = height;
+        image.colorType = LCT_RGB;
+        image.channels = 3;
+        image.pixels.resize(width * height * 3);
+        unsigned cx = random.next() % width, cy = random.next() % height;
+        for (unsigned y = 0; y < height; y++) {
+            for (unsigned x = 0; x < width; x++) {
+                int dx = static_cast<int>(x) - static_cast<int>(cx);
+                int dy = static_cast<int>(y) - static_cast<int>(cy);
+                int blob = 255 - static_cast<int>((dx * dx + dy * dy) >> 10);
+                if (blob < 0) blob = 0;
+                unsigned char *pixel = &image.pixels[(y * width + x) * 3];
+                pixel[0] = static_cast<unsigned char>((x * 255 / width + blob) / 2 + random.next() % 8);
+                pixel[1] = static_cast<unsigned char>((y * 255 / height + blob) / 2 + random.next() % 8);
+                pixel[2] = static_cast<unsigned char>(((x + y) * 255 / (width + height)) / 2 + random.next() % 8);
+            }
+        }
+        return image;
+    }
+
+    // Runs kernel until at least minMs passed, 3 times, and prints the fastest.
+    template<typename Kernel>
+    void measure(const std::string &kernel, const std::string &input, std::size_t bytes, Kernel run,
+            const std::string &extra = "") {
+        double best = 0;
+        for (int trial = 0; trial < 3; trial++) {
+            std::size_t calls = 0;
+            Clock::time_point start = Clock::now();
+            double ms = 0;
+            do {
+                run();
+                calls++;
+                ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+            } while (ms < options.minMs);
+            double nsPerCall = ms * 1e6 / calls;
+            if (trial == 0 || nsPerCall < best) best = nsPerCall;
+        }
+        std::printf("%s    {\"kernel\": \"%s\", \"input\": \"%s\", \"bytes\": %zu, \"ns_per_call\": %.1f, "
+                "\"mb_per_s\": %.1f%s}", firstResult ? "" : ",\n", kernel.c_str(), input.c_str(), bytes, best,
+                bytes / best * 1e3, extra.c_str());
+        firstResult = false;
+    }
+
+    void benchChecksums(const Image &image) {
+        const unsigned char *data = image.pixels.data();
+        unsigned size = static_cast<unsigned>(image.pixels.size());
+        volatile unsigned sink = 0;
+        measure("lodepng_crc32", image.name, size, [&]() { sink = lodepng_crc32(data, size); });
+        measure("update_adler32", image.name, size, [&]() { sink = update_adler32(1u, data, size); });
+        measure("update_adler32_scalar", image.name, size, [&]() { sink = update_adler32_scalar(1u, data, size); });
+#ifdef LODEPNG_SIMD_X86
+        if (__builtin_cpu_supports("ssse3")) {
+            measure("update_adler32_ssse3", image.name, size, [&]() { sink = update_adler32_ssse3(1u, data, size); });
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            measure("update_adler32_avx2", image.name, size, [&]() { sink = update_adler32_avx2(1u, data, size); });
+        }
+#endif
+        (void)sink;
+    }
+
+    void benchFilters(const Image &image) {
+        std::size_t linebytes = image.width * image.channels;
+        std::size_t bytewidth = image.channels;
+        std::vector<unsigned char> filtered(linebytes * image.height);
+        std::vector<unsigned char> recon(linebytes * image.height);
+        for (unsigned char type = 0; type < 5; type++) {
+            std::string suffix = "_" + std::to_string(type);
+            measure("filterScanline" + suffix, image.name, image.pixels.size(), [&]() {
+                for (unsigned y = 0; y < image.height; y++) {
+                    const unsigned char *prev = y ? &image.pixels[(y - 1) * linebytes] : 0;
+                    filterScanline(&filtered[y * linebytes], &image.pixels[y * linebytes], prev,
+                            linebytes, bytewidth, type);
+                }
+            });
+            measure("unfilterScanline" + suffix, image.name, image.pixels.size(), [&]() {
+                for (unsigned y = 0; y < image.height; y++) {
+                    const unsigned char *prev = y ? &recon[(y - 1) * linebytes] : 0;
+                    unfilterScanline(&recon[y * linebytes], &filtered[y * linebytes], prev,
+                            bytewidth, type, linebytes);
+                }
+            });
+        }
+    }
+
+    void benchCompression(const Image &image) {
+        const unsigned char *data = image.pixels.data();
+        std::size_t size = image.pixels.size();
+        LodePNGCompressSettings settings;
+        lodepng_compress_settings_init(&settings);
+
+        measure("encodeLZ77", image.name, size, [&]() {
+            Hash hash;
+            uivector symbols;
+            uivector_init(&symbols);
+            if (!hash_init(&hash, settings.windowsize)) {
+                encodeLZ77(&symbols, &hash, data, 0, size, &settings);
+            }
+            hash_cleanup(&hash);
+            uivector_cleanup(&symbols);
+        });
+
+        const char *names[] = {"deflateFixed", "deflateDynamic"};
+        for (unsigned btype = 1; btype <= 2; btype++) {
+            settings.btype = btype;
+            unsigned char *compressed = 0;
+            std::size_t compressedSize = 0;
+            lodepng_deflate(&compressed, &compressedSize, data, size, &settings);
+            std::string ratio = ", \"out_bytes\": " + std::to_string(compressedSize);
+            measure(names[btype - 1], image.name, size, [&]() {
+                unsigned char *out = 0;
+                std::size_t outSize = 0;
+                lodepng_deflate(&out, &outSize, data, size, &settings);
+                lodepng_free(out);
+            }, ratio);
+
+            LodePNGDecompressSettings decompress;
+            lodepng_decompress_settings_init(&decompress);
+            measure(std::string("inflate_") + (btype == 1 ? "fixed" : "dynamic"), image.name, size, [&]() {
+                unsigned char *out = 0;
+                std::size_t outSize = 0;
+                lodepng_inflate(&out, &outSize, compressed, compressedSize, &decompress);
+                lodepng_free(out);
+            });
+            lodepng_free(compressed);
+        }
+    }
+
+    void benchConvert(const Image &image) {
+        LodePNGColorMode in = lodepng_color_mode_make(image.colorType, 8);
+        const LodePNGColorType targets[] = {LCT_RGBA, LCT_RGB, LCT_GREY};
+        const char *names[] = {"rgba8", "rgb8", "grey8"};
+        std::vector<unsigned char> out(image.width * image.height * 4);
+        for (int i = 0; i < 3; i++) {
+            if (targets[i] == image.colorType) continue;
+            // Only greyscale converts losslessly to grey.
+            if (targets[i] == LCT_GREY && image.colorType != LCT_GREY) continue;
+            LodePNGColorMode mode = lodepng_color_mode_make(targets[i], 8);
+            measure(std::string("lodepng_convert_to_") + names[i], image.name, image.pixels.size(), [&]() {
+                lodepng_convert(out.data(), image.pixels.data(), &mode, &in, image.width, image.height);
+            });
+        }
+    }
+
+    void parseOptions(int argc, char **argv) {
+        for (int i = 1; i < argc; i++) {
+            bool hasValue = i + 1 < argc;
+            if (!std::strcmp(argv[i], "--seed") && hasValue) {
+                options.seed = static_cast<unsigned>(std::strtoul(argv[++i], 0, 10));
+            } else if (!std::strcmp(argv[i], "--min-ms") && hasValue) {
+                options.minMs = std::atof(argv[++i]);
+            } else {
+                std::fprintf(stderr, "usage: %s [--seed N] [--min-ms N]\n", argv[0]);
+                std::exit(1);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    parseOptions(argc, argv);
+    Random random(options.seed);
+    std::vector<Image> images;
+    images.push_back(barcodeImage(1, random));
+    images.push_back(barcodeImage(8, random));
+    images.push_back(photoImage(1024, 768, random));
+
+    std::printf("{\n  \"seed\": %u,\n  \"results\": [\n", options.seed);
+    for (const Image &image : images) {
+        benchChecksums(image);
+        benchFilters(image);
+        benchCompression(image);
+        benchConvert(image);
+    }
+    std::printf("\n  ]\n}\n");
+    return 0;
+}
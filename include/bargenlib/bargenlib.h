@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
 #include <vector>
 #include <string>
 
@@ -29,10 +32,496 @@ namespace bargenlib
         PNG_A = 2,
     };
 
+    /*
+     * A barcode drawn into pixels, before it is encoded as a file. The rows are
+     * top to bottom with one byte per pixel for BMP (palette index, 1 is a bar)
+     * and PNG (grey), and two for PNG_A (grey and alpha).
+     */
+    struct Raster {
+        FileType fileType;
+        int width;
+        int height;
+        std::vector<unsigned char> pixels;
+    };
+
+    /*
+     * Draws a barcode with the given encoding into pixels for the file type.
+     * save() is rasterize(), encode() and a write of the result to the disk.
+     */
+    Raster rasterize(const std::vector<int> &code, Encoding codeType, FileType fileType);
+
+    /*
+     * Encodes a rasterized barcode into the bytes of its image file. Throws a
+     * std::invalid_argument if the pixels don't match the width and height,
+     * or if a BMP's width is not a multiple of 4 (rows are not padded).
+     */
+    std::vector<unsigned char> encode(const Raster &raster);
+
+    /*
+     * Returns the image file bytes of a barcode, like encode(rasterize()),
+     * but served from the render cache when it holds them. save() renders
+     * through it too.
+     */
+    std::vector<unsigned char> render(const std::vector<int> &code, Encoding codeType, FileType fileType);
+
+    /*
+     * The render cache keeps recently rendered image files, keyed by their
+     * digits, encoding and file type, up to a total number of bytes and
+     * evicting the least recently used first. It is split into shards with
+     * their own locks, so threads rarely wait on each other. It is off
+     * (0 bytes) until a capacity is set; lowering it evicts right away.
+     */
+    struct CacheStats {
+        std::uint64_t hits;
+        std::uint64_t misses;
+        std::uint64_t evictions;
+        std::uint64_t entries;
+        std::uint64_t bytes;
+        std::uint64_t diskHits;    // see openDiskCache()
+        std::uint64_t diskMisses;
+    };
+
+    void setCacheCapacity(std::size_t bytes);
+    CacheStats cacheStats();
+    void clearCache();
+
+    /*
+     * Opens a render cache that persists in directory (which must exist),
+     * behind the in-memory one: bargenlib.blob holds the image files, appended
+     * and never rewritten, and bargenlib.index a hash table of their offsets.
+     * Both are memory mapped and lookups take no locks, so a restarted
+     * process serves the images at once, and processes can share the files.
+     * maxBytes bounds the blob, and slots (rounded up to a power of two) the
+     * number of images; a full cache keeps serving but stops adding. slots
+     * only applies when the index is created. Returns false if the files
+     * cannot be opened or mapped, or on platforms without mmap.
+     *
+     * Don't open or close the cache while other threads are rendering.
+     */
+    bool openDiskCache(const std::string &directory, std::size_t maxBytes = std::size_t(1) << 30,
+            std::size_t slots = std::size_t(1) << 20);
+    void closeDiskCache();
+
+    /*
+     * Where an image file is stored in an open file, so that it can be sent
+     * to a socket by the kernel (sendfile() or splice()) instead of being
+     * copied through a buffer. The disk cache and archives hand these out.
+     */
+    struct FileRegion {
+        int fd;
+        std::uint64_t offset;
+        std::uint64_t size;
+    };
+
+    /*
+     * Finds the image file of a barcode in the disk cache, rendering and
+     * adding it first if it is missing. Its region stays valid until the
+     * disk cache is closed, since stored images are never rewritten; the
+     * descriptor belongs to the cache and must not be closed. Returns false
+     * if no disk cache is open or the image could not be added to it (the
+     * cache is full), and throws like rasterize() for invalid codes.
+     */
+    bool renderRegion(const std::vector<int> &code, Encoding codeType, FileType fileType, FileRegion &region);
+
+    /*
+     * Sends as much of a region to out as it takes, with sendfile() on
+     * Linux (a read and write elsewhere), and advances the region past the
+     * bytes sent. With a non-blocking out, a region left non-empty means out
+     * was full. Returns false on errors.
+     */
+    bool sendRegion(int out, FileRegion &region);
+
+    /*
+     * Writes many barcodes into one archive file instead of a file each: the
+     * images back to back, then an index of their codes, offsets, sizes and
+     * file types. Images are rendered like render() does. finish() writes the
+     * index; the destructor calls it if needed. Throws a std::runtime_error
+     * if the file cannot be written.
+     */
+    class ArchiveWriter {
+    public:
+        explicit ArchiveWriter(const std::string &path);
+        ~ArchiveWriter();
+        void add(const std::vector<int> &code, Encoding codeType, FileType fileType);
+        void finish();
+
+    private:
+        ArchiveWriter(const ArchiveWriter &);
+        ArchiveWriter &operator=(const ArchiveWriter &);
+        struct Impl;
+        Impl *impl;
+    };
+
+    /*
+     * Streams images into a tar (POSIX ustar) or zip bundle as they are
+     * rendered, without writing them to their own files first. Zip entries
+     * are stored uncompressed, as PNG and BMP barcodes gain little from
+     * deflate; large bundles use zip64. Both formats are written front to
+     * back, so out can be a pipe or a network stream. finish() writes the
+     * end of the bundle; the destructor calls it if needed. Throws a
+     * std::runtime_error if writing fails or a name does not fit the format.
+     */
+    enum BundleFormat {
+        TAR = 0,
+        ZIP = 1,
+    };
+
+    class BundleWriter {
+    public:
+        BundleWriter(const std::string &path, BundleFormat format);
+        BundleWriter(std::ostream &out, BundleFormat format);
+        ~BundleWriter();
+        void add(const std::string &name, const std::vector<int> &code, Encoding codeType, FileType fileType);
+        void add(const std::string &name, const std::vector<unsigned char> &file);
+        void finish();
+
+    private:
+        BundleWriter(const BundleWriter &);
+        BundleWriter &operator=(const BundleWriter &);
+        struct Impl;
+        Impl *impl;
+    };
+
+    /*
+     * Writes image files in the background for batch jobs, so the disk works
+     * while the caller renders the next images. On Linux the open, write and
+     * close of many files are batched into a few io_uring system calls;
+     * where io_uring is not available, a pool of threads writes them with
+     * pwrite. If io_uring fails during a batch, the files in flight are
+     * reported as failed with its errno and the pool writes the rest. At
+     * most queueDepth files are in flight, and submit() waits for room.
+     * Write failures don't throw: wait() waits for every submitted file and
+     * returns the ones that could not be written since the last wait(), with
+     * their errno. An AsyncWriter must only be used by one thread.
+     */
+    struct WriteError {
+        std::string path;
+        int error;
+    };
+
+    class AsyncWriter {
+    public:
+        explicit AsyncWriter(std::size_t queueDepth = 64, int threads = 4);
+        ~AsyncWriter();
+        void submit(const std::string &path, std::vector<unsigned char> file);
+        void submit(const std::string &path, const std::vector<int> &code, Encoding codeType, FileType fileType);
+        std::vector<WriteError> wait();
+        bool usesIoUring() const;
+
+    private:
+        AsyncWriter(const AsyncWriter &);
+        AsyncWriter &operator=(const AsyncWriter &);
+        struct Impl;
+        Impl *impl;
+    };
+
+    /*
+     * Writes batches of files so that each one appears complete or not at
+     * all, even after a crash, without paying for an fsync per file. Files
+     * are written by an AsyncWriter under a hidden temporary name next to
+     * their path. Every groupSize files, and on commit(), the group is made
+     * durable with one syncfs() per file system on Linux (an fsync per file
+     * elsewhere), renamed to the final names, and each directory involved
+     * is fsynced once. commit() returns the files that failed since the
+     * last commit(); they are not renamed, except those whose directory
+     * could not be fsynced. Submitting a path already in the current group
+     * commits the group first, so the later file wins. The destructor
+     * commits. A DurableWriter must only be used by one thread.
+     */
+    class DurableWriter {
+    public:
+        explicit DurableWriter(std::size_t groupSize = 1024);
+        ~DurableWriter();
+        void submit(const std::string &path, std::vector<unsigned char> file);
+        void submit(const std::string &path, const std::vector<int> &code, Encoding codeType, FileType fileType);
+        std::vector<WriteError> commit();
+
+    private:
+        DurableWriter(const DurableWriter &);
+        DurableWriter &operator=(const DurableWriter &);
+        struct Impl;
+        Impl *impl;
+    };
+
+    /*
+     * Spreads a large batch of files over subdirectories of root, so that no
+     * directory grows big enough to slow down creating and looking up files.
+     * With SHARD_HASH, a hash of the digits picks one of fanOut directories
+     * per level, spreading files evenly. With SHARD_PREFIX, the leading
+     * digits pick it, keeping related codes together; fanOut must then be
+     * 10, 100 or 1000 (1, 2 or 3 digits per level). Directories are named by
+     * zero-padded numbers, like root/042/017. The constructor creates the
+     * whole tree once (fanOut^levels directories), so writes never need to
+     * check for it, and throws a std::runtime_error if it cannot; trees of
+     * more than 2^20 directories are rejected with a std::invalid_argument,
+     * as are codes with digits outside 0-9.
+     */
+    enum ShardScheme {
+        SHARD_HASH = 0,
+        SHARD_PREFIX = 1,
+    };
+
+    class ShardedLayout {
+    public:
+        explicit ShardedLayout(const std::string &root, ShardScheme scheme = SHARD_HASH, int fanOut = 256,
+                int levels = 1);
+
+        // The directory for a code, without a trailing slash.
+        std::string directory(const std::vector<int> &code) const;
+
+        // directory(code) + "/" + the digits + ".bmp" or ".png".
+        std::string path(const std::vector<int> &code, FileType fileType) const;
+
+    private:
+        std::string root;
+        ShardScheme scheme;
+        int fanOut;
+        int levels;
+        int width;  // digits of a directory name
+    };
+
+    /*
+     * An image in an archive. Its bytes are at offset in the archive file.
+     * The code is as it was given to ArchiveWriter::add().
+     */
+    struct ArchiveEntry {
+        Encoding codeType;
+        FileType fileType;
+        std::vector<int> code;
+        std::uint64_t offset;
+        std::uint64_t size;
+    };
+
+    /*
+     * Reads an archive written by ArchiveWriter, memory mapped where mmap is
+     * available. The image bytes returned point into the mapping and stay
+     * valid while the reader exists. fd() is the open archive, and region()
+     * where an image is in it, for sending images with sendRegion(). Throws
+     * a std::runtime_error if the file cannot be read or is not an archive.
+     */
+    class ArchiveReader {
+    public:
+        explicit ArchiveReader(const std::string &path);
+        ~ArchiveReader();
+        std::size_t size() const;
+        const ArchiveEntry &entry(std::size_t index) const;
+        const unsigned char *data(const ArchiveEntry &entry) const;
+        const ArchiveEntry *find(const std::vector<int> &code, Encoding codeType, FileType fileType) const;
+        int fd() const;
+        FileRegion region(const ArchiveEntry &entry) const;
+
+    private:
+        ArchiveReader(const ArchiveReader &);
+        ArchiveReader &operator=(const ArchiveReader &);
+        struct Impl;
+        Impl *impl;
+    };
+
+    /*
+     * Hands rendered images to other processes on the same host through
+     * shared memory instead of files: a ring of slots in a memfd, each
+     * holding one image file and its code. push() renders the image like
+     * render() and copies it into the next slot, waiting up to timeoutMs
+     * (-1: forever) while every slot is full, and returns false on timeout.
+     * slots is rounded up to a power of two, and images bigger than slotSize
+     * throw a std::runtime_error. Readers open the ring with fd() (passed
+     * over a Unix socket, say) or path(), which processes of the same user
+     * can open. The two sides wait on futexes and only make system calls
+     * when the other side is waiting. The destructor closes the ring. A
+     * RingWriter must only be used by one thread. Rings need Linux; the
+     * constructor throws a std::runtime_error elsewhere.
+     */
+    struct RingImage {
+        Encoding codeType;
+        FileType fileType;
+        std::vector<int> code;
+        std::vector<unsigned char> file;
+    };
+
+    class RingWriter {
+    public:
+        explicit RingWriter(std::size_t slots = 64, std::size_t slotSize = 65536);
+        ~RingWriter();
+        bool push(const std::vector<int> &code, Encoding codeType, FileType fileType, int timeoutMs = -1);
+        int fd() const;
+        std::string path() const;
+
+    private:
+        RingWriter(const RingWriter &);
+        RingWriter &operator=(const RingWriter &);
+        struct Impl;
+        Impl *impl;
+    };
+
+    /*
+     * Reads the images of a RingWriter's ring, in the order they were
+     * pushed. Any number of readers, in any threads and processes, can
+     * share a ring; each image goes to one of them. pop() waits up to
+     * timeoutMs (-1: forever) for an image, and returns false on timeout or
+     * once the ring is closed and empty, which closed() tells apart. The
+     * reader maps the ring, so fd can be closed afterwards. A reader that
+     * dies while copying an image out keeps its slot for good, which stalls
+     * the writer once it comes round to it. Throws a std::runtime_error if
+     * the ring cannot be mapped.
+     */
+    class RingReader {
+    public:
+        explicit RingReader(int fd);
+        explicit RingReader(const std::string &path);
+        ~RingReader();
+        bool pop(RingImage &image, int timeoutMs = -1);
+        bool closed() const;
+
+    private:
+        RingReader(const RingReader &);
+        RingReader &operator=(const RingReader &);
+        struct Impl;
+        Impl *impl;
+    };
+
     /*
      * Exports a barcode image to the disk at the specified file path with
      * the specified file type. The barcode's encoding must be specified with
      * through the CodeType enumerator so the appropriate encoding is used.
+     *
+     * With verify set, the written image is read back from the disk and its
+     * middle scanline is decoded into digits, which must match the given code
+     * (plus its check digit, if that was left out). A std::runtime_error is
+     * thrown otherwise. This decodes a single scanline, so it is cheap enough
+     * to leave on for every image.
+     */
+    void save(const std::vector<int> &code, const std::string &path, Encoding codeType, FileType fileType,
+            bool verify = false);
+
+    /*
+     * A barcode read back by the decoder. The code includes the check digit.
+     * EAN-13 codes starting with 0 are reported as UPC-A without that digit.
+     */
+    struct Barcode {
+        Encoding codeType;
+        std::vector<int> code;
+    };
+
+    /*
+     * Decodes a barcode from a greyscale scanline (one byte per pixel, dark
+     * bars on a light background) of any scale, using the widths of its bars
+     * and spaces. Modules should be at least 2 pixels wide, unless they are
+     * exactly 1 pixel like in the images save() writes. Returns false if no
+     * valid EAN-13, UPC-A or EAN-8 barcode with a correct check digit was found.
+     */
+    bool decodeScanline(const unsigned char *pixels, std::size_t width, Barcode &barcode);
+
+    /*
+     * Decodes a barcode from a greyscale image (width bytes per row) by trying
+     * up to 9 rows, starting in the middle. Returns false if none decoded.
+     */
+    bool decodeImage(const unsigned char *pixels, std::size_t width, std::size_t height, Barcode &barcode);
+
+    /*
+     * Instrumentation of the stages of save(), rasterize() and encode().
+     * It is only recorded when bargenlib.cpp is compiled with
+     * -DBARGENLIB_INSTRUMENT, otherwise it compiles away and stats() stays
+     * zero. Adding -DLODEPNG_NO_COMPILE_ALLOCATORS to both bargenlib.cpp and
+     * lodepng.cpp also counts lodepng's allocations.
+     */
+    enum Stage {
+        STAGE_VALIDATE = 0,     // checking the code's digits
+        STAGE_INIT_IMAGE = 1,   // allocating and clearing the pixels
+        STAGE_DRAW = 2,         // drawing guards and digits
+        STAGE_PNG_FILTER = 3,   // lodepng's color analysis and scanline filters
+        STAGE_PNG_DEFLATE = 4,  // lodepng's zlib compression
+        STAGE_PNG_CHUNKS = 5,   // lodepng's chunk assembly
+        STAGE_BMP_ENCODE = 6,   // BMP headers and pixels
+        STAGE_WRITE = 7,        // writing the file
+        STAGE_VERIFY = 8,       // save()'s verify step
+        STAGE_COUNT = 9,
+    };
+
+    struct StageStats {
+        std::uint64_t calls;
+        std::uint64_t nanoseconds;
+    };
+
+    struct Stats {
+        std::uint64_t calls;         // save(), rasterize() and encode() calls, not nested ones
+        std::uint64_t errors;        // calls that threw, and files that could not be written
+        std::uint64_t bytesIn;       // raster bytes given to the image encoders
+        std::uint64_t bytesOut;      // encoded image file bytes
+        std::uint64_t bytesWritten;  // bytes written to files
+        std::uint64_t allocations;   // lodepng allocations, see above
+        StageStats stages[STAGE_COUNT];
+    };
+
+    /*
+     * Returns whether bargenlib was compiled with BARGENLIB_INSTRUMENT.
+     */
+    bool statsEnabled();
+
+    /*
+     * Returns the totals recorded over all threads since the start or the
+     * last resetStats().
+     */
+    Stats stats();
+    void resetStats();
+
+    /*
+     * Returns the counters above and latency summaries of save() in the
+     * Prometheus text exposition format. The summaries are per encoding and
+     * file type, for the whole call, rasterizing plus encoding, and writing,
+     * with p50, p90, p99 and p99.9 read from log-bucketed histograms (within
+     * about 6%). Empty without BARGENLIB_INSTRUMENT.
+     */
+    std::string metricsText();
+
+    /*
+     * Writes metricsText() to path by renaming a temporary file over it, as
+     * node exporter's textfile collector expects. Returns false on failure or
+     * without BARGENLIB_INSTRUMENT.
+     */
+    bool writeMetrics(const std::string &path);
+
+    /*
+     * Sets a function called with the stats of each save(), rasterize() or
+     * encode() call when it finishes, on the calling thread. Pass a null
+     * callback to remove it.
+     */
+    typedef void (*StatsCallback)(const Stats &stats, void *context);
+    void setStatsCallback(StatsCallback callback, void *context);
+
+    /*
+     * Starts recording a timeline of save(), rasterize() and encode() calls
+     * and their stages on every thread, for viewing in chrome://tracing or
+     * ui.perfetto.dev. Each thread keeps its last eventsPerThread spans in
+     * its own ring buffer, so recording takes no locks. Buffers are reused
+     * by later traces rather than freed, so traces can be started and
+     * stopped while instrumented threads run. Like Stats, this needs
+     * -DBARGENLIB_INSTRUMENT; returns false without it, or if a trace is
+     * already running.
      */
-    void save(const std::vector<int> &code, const std::string &path, Encoding codeType, FileType fileType);
+    bool startTrace(std::size_t eventsPerThread = 65536);
+
+    /*
+     * Stops the trace and writes its spans to path as Chrome Trace Event
+     * JSON. Call it once the traced threads are done; spans that end while
+     * it runs may be left out. Returns false if no trace was running or the
+     * file could not be written.
+     */
+    bool stopTrace(const std::string &path);
+
+    /*
+     * Adds a span for the caller's own work, like waiting for jobs, to the
+     * trace of the current thread. It lasts from construction to destruction.
+     * The name must outlive the trace, so use a string literal.
+     */
+    class TraceSpan {
+    public:
+        explicit TraceSpan(const char *name);
+        ~TraceSpan();
+
+    private:
+        TraceSpan(const TraceSpan &);
+        TraceSpan &operator=(const TraceSpan &);
+        const char *name;
+        std::int64_t start;
+    };
 }
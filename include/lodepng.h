@@ -37,7 +37,9 @@ The "NO_COMPILE" defines are designed to be used to pass as defines to the
 compiler command to disable them without modifying this header, e.g.
 -DLODEPNG_NO_COMPILE_ZLIB for gcc.
 In addition to those below, you can also define LODEPNG_NO_COMPILE_CRC to
-allow implementing a custom lodepng_crc32.
+allow implementing a custom lodepng_crc32, and LODEPNG_NO_COMPILE_SIMD to only
+use the portable versions of the checksum and other hot loops, even on CPUs
+where a vectorized kernel would be selected at runtime.
 */
 /*deflate & zlib. If disabled, you must specify alternative zlib functions in
 the custom_zlib field of the compress and decompress settings*/
@@ -301,6 +303,23 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
   unsigned minmatch; /*minimum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*maximum number of hash chain entries to try per position. 0 uses windowsize for windows of
+  8192 or more and windowsize / 8 otherwise. Lower is faster but compresses less. Default: 0*/
+  unsigned maxchainlength;
+  /*with lazy matching, search only a quarter of maxchainlength when the pending match is already
+  at least this long (as zlib's good_length). 0 to always search the full chain. Default: 0*/
+  unsigned goodlength;
+  /*hash 4 bytes with a multiplicative hash instead of 3 bytes with shift and xor. Gives fewer,
+  longer candidates, so it is faster but rarely finds matches of length 3. Default: false*/
+  unsigned fastmatch;
+
+  /*Number of threads for deflate. With more than one, input larger than one deflate block
+  is split into chunks that are compressed concurrently, each primed with the preceding
+  window of input as dictionary, and joined into one standard zlib stream. 0 uses one
+  thread per hardware thread. The PNG encoder also uses this many threads to choose the
+  LFS_MINSUM and LFS_ENTROPY filters of large images in bands of rows. Only has effect
+  when compiled as C++11. Default: 1*/
+  unsigned numthreads;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -793,6 +812,54 @@ unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+Streaming PNG encoder. Instead of taking the whole image at once like lodepng_encode,
+it takes the image rows in order, in any number of calls, and gives the PNG file to an
+output sink piece by piece: the header chunks when it begins, IDAT chunks as soon as
+enough compressed data is available, and the last IDAT and IEND chunks when finished.
+Its memory use is bounded by a few deflate blocks, independent of the image height.
+
+Usage: lodepng_stream_encoder_begin, then lodepng_stream_encoder_push_rows until all h
+rows are given, then lodepng_stream_encoder_finish. Always call
+lodepng_stream_encoder_cleanup afterwards, also after an error.
+
+Differences with lodepng_encode:
+-the rows must already be in the color type and bit depth of the PNG, which is taken
+ from state->info_png.color: auto_convert and info_raw are ignored. For bit depths
+ below 8, each row starts at a byte boundary, like in the PNG file.
+-interlacing and LFS_BRUTE_FORCE are not supported (error 109).
+-ancillary chunks (text, time, unknown chunks, ...) are not written.
+-custom_zlib and custom_deflate are not used, and numthreads is ignored.
+*/
+typedef struct LodePNGStreamEncoder LodePNGStreamEncoder;
+
+/*Receives the next size bytes of the PNG file. Returns 0 to continue, or a nonzero
+error code to abort, the encoder functions then return that code.*/
+typedef unsigned (*LodePNGStreamSink)(void* context, const unsigned char* data, size_t size);
+
+/*
+Creates the encoder in *encoder and outputs the PNG signature and header chunks.
+state: PNG color mode and encoder settings, copied (predefined_filters too) so it does not need
+to stay alive.
+idatsize: the size of the data of each IDAT chunk (the last one may be smaller), 0 for 65536.
+sink, context: the output function, and the context it is called with.
+*/
+unsigned lodepng_stream_encoder_begin(LodePNGStreamEncoder** encoder, unsigned w, unsigned h,
+                                      const LodePNGState* state, size_t idatsize,
+                                      LodePNGStreamSink sink, void* context);
+
+/*Filters and compresses the next numrows rows of the image, stored one after another.*/
+unsigned lodepng_stream_encoder_push_rows(LodePNGStreamEncoder* encoder, const unsigned char* rows,
+                                          unsigned numrows);
+
+/*Compresses the remaining data and outputs the last chunks. All rows must have been given.*/
+unsigned lodepng_stream_encoder_finish(LodePNGStreamEncoder* encoder);
+
+/*Frees the encoder. Does nothing if encoder is NULL.*/
+void lodepng_stream_encoder_cleanup(LodePNGStreamEncoder* encoder);
+#endif /*LODEPNG_COMPILE_ZLIB*/
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
@@ -962,6 +1029,26 @@ filename: the path to the file to save to
 return value: error code (0 means ok)
 */
 unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const char* filename);
+
+/*A read-only view of the whole contents of a file, see lodepng_map_file.*/
+typedef struct LodePNGFileView {
+  const unsigned char* data; /*the file contents, NULL if the file is empty*/
+  size_t size; /*size of the file in bytes*/
+  unsigned mapped; /*whether data is a memory mapping (1) or an allocated buffer (0)*/
+} LodePNGFileView;
+
+/*
+Makes the contents of a file available in memory with a single open, to pass them to
+e.g. lodepng_decode or lodepng_inspect. On POSIX systems the file is memory mapped
+instead of copied into a buffer. Elsewhere, or when compiled with
+LODEPNG_NO_COMPILE_MMAP, it is loaded like lodepng_load_file. The file should not be
+truncated while mapped. Release the view with lodepng_unmap_file, also on error.
+return value: error code (0 means ok)
+*/
+unsigned lodepng_map_file(LodePNGFileView* view, const char* filename);
+
+/*Releases the memory of a view filled in by lodepng_map_file.*/
+void lodepng_unmap_file(LodePNGFileView* view);
 #endif /*LODEPNG_COMPILE_DISK*/
 
 #ifdef LODEPNG_COMPILE_CPP
@@ -1008,6 +1095,21 @@ Save the binary data in an std::vector to a file on disk. The file is overwritte
 without warning.
 */
 unsigned save_file(const std::vector<unsigned char>& buffer, const std::string& filename);
+
+/*
+A file mapped into memory with lodepng_map_file, unmapped when destroyed.
+Example: lodepng::MappedFile file; if(!file.open(filename)) lodepng_inspect(&w, &h, &state, file.data, file.size);
+*/
+class MappedFile : public LodePNGFileView {
+  public:
+    MappedFile();
+    ~MappedFile();
+    /*maps the file, after unmapping the previous one. Returns error code (0 means ok)*/
+    unsigned open(const std::string& filename);
+  private:
+    MappedFile(const MappedFile&); /*not copyable*/
+    MappedFile& operator=(const MappedFile&);
+};
 #endif /* LODEPNG_COMPILE_DISK */
 #endif /* LODEPNG_COMPILE_PNG */
 
@@ -1,13 +1,83 @@
 #include "bargenlib/bargenlib.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <fstream>
+#include <iterator>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <array>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "lodepng.h"
 
+#ifdef BARGENLIB_INSTRUMENT
+#include <chrono>
+#include <cstdarg>
+#include <cstdlib>
+#endif
+
+#ifdef BARGENLIB_USDT
+#include <sys/sdt.h>
+#endif
+
+// POSIX file APIs, for the disk cache, archives, the writers and sharding.
+// Elsewhere these fall back to the standard library or are unavailable.
+#if defined(__unix__) || defined(__APPLE__)
+#define BARGENLIB_POSIX
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// sendRegion() uses sendfile() where it can send from a file to any descriptor.
+#ifdef __linux__
+#define BARGENLIB_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+// decodeScanline() thresholds pixels 16 at a time with SSE2, which every
+// x86-64 processor has.
+#if defined(__SSE2__) && defined(__GNUC__)
+#define BARGENLIB_SSE2
+#include <emmintrin.h>
+#endif
+
+// The shared-memory ring of RingWriter and RingReader lives in a memfd, and
+// its two sides wait for each other on futexes.
+#ifdef __linux__
+#define BARGENLIB_RING
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// AsyncWriter talks to io_uring with raw system calls, so only the kernel's
+// header is needed, not liburing.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define BARGENLIB_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
 namespace bargenlib
 {
     using std::uint16_t;
@@ -76,6 +146,364 @@ namespace bargenlib
         0b0011010,  // 9
     }};
 
+    // Inverse of the tables above, for decoding: the widths of each digit's 4 runs
+    // in modules, L digits 0-9 first, then G digits 0-9 (the L widths reversed). R
+    // digits have the same widths as L digits, they only start with a bar.
+    std::array<std::array<uint8_t, 4>, 20> makeDigitWidths() {
+        std::array<std::array<uint8_t, 4>, 20> widths;
+        for (int digit = 0; digit < 10; digit++) {
+            std::array<uint8_t, 4> &l = widths[digit];
+            l.fill(0);
+            int run = 0;
+            for (int i = 0; i < 7; i++) {
+                int module = (UpcEncodeTable[digit] >> (6 - i)) & 1;
+                if (i > 0 && module != ((UpcEncodeTable[digit] >> (7 - i)) & 1)) run++;
+                l[run]++;
+            }
+            for (int i = 0; i < 4; i++) widths[digit + 10][i] = l[3 - i];
+        }
+        return widths;
+    }
+
+    const std::array<std::array<uint8_t, 4>, 20> DigitWidths = makeDigitWidths();
+
+    // Maps rounded run widths (minus one in two bits each, first run in the highest
+    // bits) to their index in DigitWidths, or DecodeInvalid if they are not a digit.
+    const uint8_t DecodeInvalid = 0xFF;
+
+    std::array<uint8_t, 256> makeDigitWidthTable() {
+        std::array<uint8_t, 256> table;
+        table.fill(DecodeInvalid);
+        for (int index = 0; index < 20; index++) {
+            int key = 0;
+            for (int i = 0; i < 4; i++) key = (key << 2) | (DigitWidths[index][i] - 1);
+            table[key] = index;
+        }
+        return table;
+    }
+
+    const std::array<uint8_t, 256> DigitWidthTable = makeDigitWidthTable();
+
+#ifdef BARGENLIB_INSTRUMENT
+    // Instrumentation, see Stats. Each thread records into its own Stats during a
+    // public call, which is added to the totals when the outermost call ends.
+    using Clock = std::chrono::steady_clock;
+
+    std::mutex StatsMutex;
+    Stats TotalStats = Stats();
+    StatsCallback Callback = nullptr;
+    void *CallbackContext = nullptr;
+
+    thread_local Stats CurrentStats;
+    thread_local int RecordDepth = 0;
+    thread_local int CurrentStage = -1;
+    thread_local Clock::time_point StageStart;
+
+    const char *StageNames[STAGE_COUNT] = {
+        "validate", "init_image", "draw", "png_filter", "png_deflate", "png_chunks", "bmp_encode", "write", "verify",
+    };
+
+    // Tracing, see startTrace(). Each thread appends spans to its own ring
+    // buffer without locking; the mutex is only taken to register a thread's
+    // buffer once per trace, and to start and stop the trace. A thread may
+    // still be writing to its buffer when the next trace starts, so buffers
+    // are never freed: a thread reuses its own in later traces, and hands it
+    // to a new thread when it exits.
+    struct TraceEvent {
+        const char *name;
+        std::uint64_t start;     // nanoseconds since TraceEpoch
+        std::uint64_t duration;  // nanoseconds
+    };
+
+    struct TraceBuffer {
+        std::vector<TraceEvent> events;
+        std::atomic<std::uint64_t> head;  // number of events written this trace
+        std::uint64_t generation;         // the trace recorded, guarded by TraceMutex
+        bool owned;                       // by a running thread, guarded by TraceMutex
+        TraceBuffer() : head(0), generation(0), owned(true) {}
+    };
+
+    std::mutex TraceMutex;
+    std::vector<std::unique_ptr<TraceBuffer>> TraceBuffers;
+    std::atomic<bool> Tracing(false);
+    std::atomic<std::uint64_t> TraceGeneration(0);
+    Clock::time_point TraceEpoch;
+    std::size_t TraceCapacity = 0;
+
+    // A thread's trace buffer, released for reuse when the thread exits.
+    struct LocalTraceBuffer {
+        TraceBuffer *buffer = nullptr;
+        std::uint64_t generation = 0;
+
+        ~LocalTraceBuffer() {
+            if (!buffer) return;
+            std::lock_guard<std::mutex> lock(TraceMutex);
+            buffer->owned = false;
+        }
+    };
+
+    thread_local LocalTraceBuffer LocalTrace;
+
+    // A buffer for the calling thread: one whose thread exited before this
+    // trace started, or a new one. TraceMutex must be held.
+    TraceBuffer *claimTraceBuffer() {
+        std::uint64_t generation = TraceGeneration.load(std::memory_order_relaxed);
+        for (std::unique_ptr<TraceBuffer> &buffer : TraceBuffers) {
+            if (!buffer->owned && buffer->generation != generation) {
+                buffer->owned = true;
+                return buffer.get();
+            }
+        }
+        TraceBuffers.emplace_back(new TraceBuffer());
+        return TraceBuffers.back().get();
+    }
+
+    std::uint64_t traceTime(Clock::time_point time) {
+        if (time < TraceEpoch) return 0;
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time - TraceEpoch).count();
+    }
+
+    void traceSpan(const char *name, Clock::time_point start, Clock::time_point end) {
+        if (!Tracing.load(std::memory_order_acquire)) return;
+        std::uint64_t generation = TraceGeneration.load(std::memory_order_acquire);
+        LocalTraceBuffer &local = LocalTrace;
+        if (!local.buffer || local.generation != generation) {
+            std::lock_guard<std::mutex> lock(TraceMutex);
+            if (!Tracing.load(std::memory_order_relaxed)) return;
+            if (!local.buffer) local.buffer = claimTraceBuffer();
+            local.buffer->events.assign(TraceCapacity, TraceEvent());
+            local.buffer->head.store(0, std::memory_order_relaxed);
+            local.generation = local.buffer->generation = TraceGeneration.load(std::memory_order_relaxed);
+        }
+        TraceBuffer &buffer = *local.buffer;
+        std::uint64_t head = buffer.head.load(std::memory_order_relaxed);
+        TraceEvent &event = buffer.events[head % buffer.events.size()];
+        event.name = name;
+        event.start = traceTime(start);
+        event.duration = traceTime(end) - event.start;
+        buffer.head.store(head + 1, std::memory_order_release);
+    }
+
+    // Writes name as a JSON string.
+    void writeJsonString(std::ofstream &out, const char *name) {
+        out << '"';
+        for (const char *c = name; *c; c++) {
+            if (*c == '"' || *c == '\\') out << '\\' << *c;
+            else if (static_cast<unsigned char>(*c) >= 0x20) out << *c;
+        }
+        out << '"';
+    }
+
+    void addStats(Stats &total, const Stats &stats) {
+        total.calls += stats.calls;
+        total.errors += stats.errors;
+        total.bytesIn += stats.bytesIn;
+        total.bytesOut += stats.bytesOut;
+        total.bytesWritten += stats.bytesWritten;
+        total.allocations += stats.allocations;
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            total.stages[i].calls += stats.stages[i].calls;
+            total.stages[i].nanoseconds += stats.stages[i].nanoseconds;
+        }
+    }
+
+    // Ends the current stage, if any, and starts the given one (or none, for -1).
+    void beginStage(int stage) {
+        Clock::time_point now = Clock::now();
+        if (CurrentStage >= 0) {
+            traceSpan(StageNames[CurrentStage], StageStart, now);
+            StageStats &current = CurrentStats.stages[CurrentStage];
+            current.calls++;
+            current.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(now - StageStart).count();
+        }
+        CurrentStage = stage;
+        StageStart = now;
+    }
+
+    // Records a public call, which counts as an error unless succeeded() is called.
+    class StatsRecord {
+    public:
+        explicit StatsRecord(const char *name) : ok(false), name(name), start(Clock::now()) {
+            if (RecordDepth++ == 0) {
+                CurrentStats = Stats();
+                CurrentStage = -1;
+            }
+        }
+
+        ~StatsRecord() {
+            beginStage(-1);
+            traceSpan(name, start, Clock::now());
+            if (--RecordDepth > 0) return;
+            CurrentStats.calls = 1;
+            if (!ok) CurrentStats.errors++;
+            StatsCallback callback;
+            void *context;
+            {
+                std::lock_guard<std::mutex> lock(StatsMutex);
+                addStats(TotalStats, CurrentStats);
+                callback = Callback;
+                context = CallbackContext;
+            }
+            if (callback) callback(CurrentStats, context);
+        }
+
+        void succeeded() { ok = true; }
+
+    private:
+        bool ok;
+        const char *name;
+        Clock::time_point start;
+    };
+
+    // Times lodepng's compression as its own stage, between filtering and chunks.
+    unsigned timedZlib(unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize,
+            const LodePNGCompressSettings *settings) {
+        beginStage(STAGE_PNG_DEFLATE);
+        unsigned error = lodepng_zlib_compress(out, outsize, in, insize, settings);
+        beginStage(STAGE_PNG_CHUNKS);
+        return error;
+    }
+
+    // Latency histograms of save(), per encoding and file type, see metricsText().
+    // Values are nanoseconds in log buckets: 8 linear sub-buckets per power of
+    // two, so a bucket is at most 12.5% wide, and recording is three relaxed
+    // atomic adds.
+    enum Latency {
+        LATENCY_TOTAL = 0,
+        LATENCY_ENCODE = 1,
+        LATENCY_WRITE = 2,
+        LATENCY_COUNT = 3,
+    };
+
+    const char *LatencyNames[LATENCY_COUNT] = {"save", "encode", "write"};
+    const char *EncodingNames[3] = {"EAN_13", "UPC_A", "EAN_8"};
+    const char *FileTypeNames[3] = {"BMP", "PNG", "PNG_A"};
+
+    const int HistogramSubBits = 3;
+    const int HistogramMaxBit = 40;  // values from 2^40 ns (18 minutes) on share the last bucket
+    const int HistogramBuckets = (HistogramMaxBit - HistogramSubBits + 2) << HistogramSubBits;
+
+    struct Histogram {
+        std::atomic<std::uint64_t> buckets[HistogramBuckets];
+        std::atomic<std::uint64_t> count;
+        std::atomic<std::uint64_t> sum;
+    };
+
+    Histogram Histograms[LATENCY_COUNT][3][3];
+
+    int histogramBucket(std::uint64_t value) {
+        const std::uint64_t subBuckets = 1u << HistogramSubBits;
+        if (value < subBuckets) return static_cast<int>(value);
+        int bit = HistogramSubBits;
+        while (bit < 63 && (value >> (bit + 1))) bit++;
+        if (bit > HistogramMaxBit) return HistogramBuckets - 1;
+        int sub = static_cast<int>((value >> (bit - HistogramSubBits)) & (subBuckets - 1));
+        return ((bit - HistogramSubBits + 1) << HistogramSubBits) + sub;
+    }
+
+    // The smallest value in the given bucket, the inverse of histogramBucket().
+    std::uint64_t histogramBucketStart(int bucket) {
+        const int subBuckets = 1 << HistogramSubBits;
+        if (bucket < subBuckets) return bucket;
+        int bit = (bucket >> HistogramSubBits) + HistogramSubBits - 1;
+        std::uint64_t sub = bucket & (subBuckets - 1);
+        return (subBuckets + sub) << (bit - HistogramSubBits);
+    }
+
+    void recordLatency(int latency, Encoding codeType, FileType fileType, Clock::duration duration) {
+        if (codeType < 0 || codeType > 2 || fileType < 0 || fileType > 2) return;
+        std::uint64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+        Histogram &histogram = Histograms[latency][codeType][fileType];
+        histogram.buckets[histogramBucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+        histogram.count.fetch_add(1, std::memory_order_relaxed);
+        histogram.sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+    }
+
+    // Times the phases of a save() call; a phase lasts from the previous lap.
+    class LatencyTimer {
+    public:
+        LatencyTimer(Encoding codeType, FileType fileType)
+            : codeType(codeType), fileType(fileType), start(Clock::now()), last(start) {}
+
+        void lap(int latency) {
+            Clock::time_point now = Clock::now();
+            recordLatency(latency, codeType, fileType, now - last);
+            last = now;
+        }
+
+        void done() { recordLatency(LATENCY_TOTAL, codeType, fileType, Clock::now() - start); }
+
+    private:
+        Encoding codeType;
+        FileType fileType;
+        Clock::time_point start;
+        Clock::time_point last;
+    };
+
+    void appendf(std::string &text, const char *format, ...) {
+        char buffer[256];
+        va_list args;
+        va_start(args, format);
+        int size = std::vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        if (size > 0) text.append(buffer, std::min<std::size_t>(size, sizeof(buffer) - 1));
+    }
+
+    // Appends one histogram as a Prometheus summary: quantiles estimated from
+    // the middle of their bucket, plus the exact sum and count.
+    void appendSummary(std::string &text, const char *name, const char *labels, const Histogram &histogram) {
+        static const double Quantiles[] = {0.5, 0.9, 0.99, 0.999};
+        std::uint64_t buckets[HistogramBuckets];
+        std::uint64_t count = 0;
+        for (int i = 0; i < HistogramBuckets; i++) {
+            buckets[i] = histogram.buckets[i].load(std::memory_order_relaxed);
+            count += buckets[i];
+        }
+        if (count == 0) return;
+        for (double quantile : Quantiles) {
+            std::uint64_t rank = static_cast<std::uint64_t>(quantile * count + 0.999999);
+            std::uint64_t seen = 0;
+            int bucket = 0;
+            while (bucket < HistogramBuckets - 1 && (seen += buckets[bucket]) < rank) bucket++;
+            double value = (histogramBucketStart(bucket) + histogramBucketStart(bucket + 1)) / 2.0;
+            appendf(text, "%s{%s,quantile=\"%g\"} %.9g\n", name, labels, quantile, value / 1e9);
+        }
+        appendf(text, "%s_sum{%s} %.9g\n", name, labels, histogram.sum.load(std::memory_order_relaxed) / 1e9);
+        appendf(text, "%s_count{%s} %llu\n", name, labels,
+                static_cast<unsigned long long>(histogram.count.load(std::memory_order_relaxed)));
+    }
+
+    #define BARGENLIB_RECORD() StatsRecord statsRecord(__func__)
+    #define BARGENLIB_RECORD_SUCCEEDED() statsRecord.succeeded()
+    #define BARGENLIB_STAGE(stage) beginStage(stage)
+    #define BARGENLIB_STAGE_END() beginStage(-1)
+    #define BARGENLIB_COUNT(field, amount) (CurrentStats.field += (amount))
+    #define BARGENLIB_TIMER(codeType, fileType) LatencyTimer latencyTimer(codeType, fileType)
+    #define BARGENLIB_LAP(latency) latencyTimer.lap(latency)
+    #define BARGENLIB_TIMER_DONE() latencyTimer.done()
+#else
+    #define BARGENLIB_RECORD()
+    #define BARGENLIB_RECORD_SUCCEEDED()
+    #define BARGENLIB_STAGE(stage)
+    #define BARGENLIB_STAGE_END()
+    #define BARGENLIB_COUNT(field, amount) ((void)0)
+    #define BARGENLIB_TIMER(codeType, fileType)
+    #define BARGENLIB_LAP(latency)
+    #define BARGENLIB_TIMER_DONE()
+#endif
+
+    // USDT probes for bpftrace and perf, under the "bargenlib" provider. Return
+    // probes only fire when the function returns normally.
+#ifdef BARGENLIB_USDT
+    #define BARGENLIB_PROBE1(name, a) DTRACE_PROBE1(bargenlib, name, a)
+    #define BARGENLIB_PROBE2(name, a, b) DTRACE_PROBE2(bargenlib, name, a, b)
+    #define BARGENLIB_PROBE3(name, a, b, c) DTRACE_PROBE3(bargenlib, name, a, b, c)
+#else
+    #define BARGENLIB_PROBE1(name, a)
+    #define BARGENLIB_PROBE2(name, a, b)
+    #define BARGENLIB_PROBE3(name, a, b, c)
+#endif
+
     enum BarRegion {
         S = 0,  // Start
         L = 1,  // Left Digit
@@ -128,6 +556,7 @@ namespace bargenlib
                     break;
                 case PNG:
                     data[(xPos * info.channels) + (y * info.bytesWidth)] = 0;
+                    break;
                 case BMP:
                 default:
                     data[(xPos * info.channels) + (y * info.bytesWidth)] = 1;
@@ -138,12 +567,13 @@ namespace bargenlib
 
     void writeGuardUPC(const ImageInfo &info, std::vector<uint8_t> &data,
             int &xPos, const BarRegion &region) {
-        if (region != BarRegion::S) xPos++;
+        // Start and end guards are 101, the middle guard is 01010.
+        if (region == BarRegion::M) xPos++;
         bargenlib::writeBar(info, data, xPos);
         xPos += 2;
         bargenlib::writeBar(info, data, xPos);
         xPos++;
-        if (region != BarRegion::E) xPos++;
+        if (region == BarRegion::M) xPos++;
     }
 
     void writeNumUPC(const ImageInfo &info, std::vector<uint8_t> &data, int &xPos,
@@ -159,162 +589,2541 @@ namespace bargenlib
         }
     }
     
-    void writePNG(const ImageInfo &info, const std::vector<uint8_t> &data, const std::string &path) {
-        std::vector<uint8_t> pngImage;
-        unsigned int error = lodepng::encode(
-                pngImage,
-                data,
-                info.width,
-                info.height,
-                (info.hasAlpha) ? LodePNGColorType::LCT_GREY_ALPHA : LodePNGColorType::LCT_GREY,
-                info.bitDepth);
-        if (!error) lodepng::save_file(pngImage, path);
-    }
-
-    void writeBMP(const ImageInfo &info, const std::vector<uint8_t> &data, const std::string &path) {
+    ImageInfo imageInfo(FileType fileType) {
+        return (fileType == PNG_A)
+                ? ImageInfo(fileType, 0, 0, 0, true, 8, 2)
+                : ImageInfo(fileType, 0, 0, 0, false, 8, 1);
+    }
+
+    void encodePNG(const ImageInfo &info, const std::vector<uint8_t> &data, std::vector<uint8_t> &file) {
+        lodepng::State state;
+        LodePNGColorType colorType = (info.hasAlpha) ? LodePNGColorType::LCT_GREY_ALPHA : LodePNGColorType::LCT_GREY;
+        state.info_raw.colortype = colorType;
+        state.info_raw.bitdepth = info.bitDepth;
+        state.info_png.color.colortype = colorType;
+        state.info_png.color.bitdepth = info.bitDepth;
+#ifdef BARGENLIB_INSTRUMENT
+        state.encoder.zlibsettings.custom_zlib = timedZlib;
+#endif
+        BARGENLIB_PROBE3(png__entry, info.width, info.height, data.size());
+        BARGENLIB_STAGE(STAGE_PNG_FILTER);
+        unsigned int error = lodepng::encode(file, data, info.width, info.height, state);
+        BARGENLIB_STAGE_END();
+        if (error) throw std::runtime_error(std::string("PNG encoding failed: ") + lodepng_error_text(error));
+        BARGENLIB_PROBE2(png__return, data.size(), file.size());
+    }
+
+    void encodeBMP(const ImageInfo &info, const std::vector<uint8_t> &data, std::vector<uint8_t> &file) {
+        BARGENLIB_PROBE3(bmp__entry, info.width, info.height, data.size());
+        BARGENLIB_STAGE(STAGE_BMP_ENCODE);
+        BMPFileHeader fileHeader(data.size());
+        BMPInfoHeader infoHeader(info.width, -info.height);
+        BMPColorTable colorTable = BMPColorTable();
+        const uint8_t *fileBytes = reinterpret_cast<const uint8_t*>(&fileHeader);
+        const uint8_t *infoBytes = reinterpret_cast<const uint8_t*>(&infoHeader);
+        const uint8_t *colorBytes = reinterpret_cast<const uint8_t*>(&colorTable);
+        file.clear();
+        file.reserve(fileHeader.fileSize);
+        file.insert(file.end(), fileBytes, fileBytes + sizeof(fileHeader));
+        file.insert(file.end(), infoBytes, infoBytes + sizeof(infoHeader));
+        file.insert(file.end(), colorBytes, colorBytes + sizeof(colorTable));
+        file.insert(file.end(), data.begin(), data.end());
+        BARGENLIB_STAGE_END();
+        BARGENLIB_PROBE2(bmp__return, data.size(), file.size());
+    }
+
+    void writeFile(const std::vector<uint8_t> &file, const std::string &path) {
+        BARGENLIB_PROBE1(write__entry, file.size());
+        BARGENLIB_STAGE(STAGE_WRITE);
         std::ofstream of(path, std::ios_base::binary);
         if (of.is_open()) {
-            BMPFileHeader fileHeader(data.size());
-            BMPInfoHeader infoHeader(info.width, -info.height);
-            BMPColorTable colorTable = BMPColorTable();
-            of.write(reinterpret_cast<const char*>(&fileHeader), sizeof(fileHeader));
-            of.write(reinterpret_cast<const char*>(&infoHeader), sizeof(infoHeader));
-            of.write(reinterpret_cast<const char*>(&colorTable), sizeof(colorTable));
-            of.write(reinterpret_cast<const char*>(data.data()), data.size());
+            of.write(reinterpret_cast<const char*>(file.data()), file.size());
         }
         of.close();
+        if (of) BARGENLIB_COUNT(bytesWritten, file.size());
+        else BARGENLIB_COUNT(errors, 1);
+        BARGENLIB_STAGE_END();
+        BARGENLIB_PROBE2(write__return, file.size(), static_cast<bool>(of));
     }
 
-    void writeImage(const ImageInfo &info, const std::vector<uint8_t> &data,
-            const std::string &path, bargenlib::FileType format) {
-        switch (format) {
-            case FileType::PNG:
-            case FileType::PNG_A:
-                writePNG(info, data, path);
-                break;
-            case FileType::BMP:
-            default:
-                writeBMP(info, data, path);
-                break;
+    // The render cache, see setCacheCapacity(). A shard is an LRU list (most
+    // recent first) with an index into it; keys are the encoding, the file
+    // type and the digits, one byte each.
+    const int CacheShards = 16;
+
+    struct CacheEntry {
+        std::string key;
+        std::shared_ptr<const std::vector<uint8_t>> file;
+    };
+
+    struct CacheShard {
+        std::mutex mutex;
+        std::list<CacheEntry> entries;
+        std::unordered_map<std::string, std::list<CacheEntry>::iterator> index;
+        std::size_t bytes = 0;
+        std::size_t capacity = 0;
+    };
+
+    CacheShard Cache[CacheShards];
+    std::atomic<bool> CacheEnabled(false);
+    std::atomic<std::uint64_t> CacheHits(0);
+    std::atomic<std::uint64_t> CacheMisses(0);
+    std::atomic<std::uint64_t> CacheEvictions(0);
+
+    // Keys hold a byte per digit, so only codes with digits 0-9 have one;
+    // callers pass other codes to rasterize(), which rejects them.
+    bool hasKey(const std::vector<int> &code) {
+        for (int digit : code) {
+            if (digit < 0 || digit > 9) return false;
         }
+        return true;
     }
 
-    void encodeEAN8(ImageInfo &info, std::vector<uint8_t> &data, const std::vector<int> &code) {
-        if (code.size() != 7 && code.size() != 8) {
-            throw std::runtime_error("A valid EAN-8 code must be 7 or 8 digits.");
+    std::string cacheKey(const std::vector<int> &code, Encoding codeType, FileType fileType) {
+        std::string key;
+        key.reserve(code.size() + 2);
+        key += static_cast<char>(codeType);
+        key += static_cast<char>(fileType);
+        for (int digit : code) key += static_cast<char>(digit);
+        return key;
+    }
+
+    CacheShard &cacheShard(const std::string &key) {
+        return Cache[std::hash<std::string>()(key) % CacheShards];
+    }
+
+    // Drops least recently used entries until the shard fits its capacity.
+    // The shard's mutex must be held.
+    void evict(CacheShard &shard) {
+        while (shard.bytes > shard.capacity && !shard.entries.empty()) {
+            CacheEntry &oldest = shard.entries.back();
+            shard.bytes -= oldest.file->size();
+            shard.index.erase(oldest.key);
+            shard.entries.pop_back();
+            CacheEvictions.fetch_add(1, std::memory_order_relaxed);
         }
-        for (int n : code) {
-            if (n < 0 || n > 9) throw std::runtime_error("An EAN-8 digit must be 0-9.");
+    }
+
+    std::shared_ptr<const std::vector<uint8_t>> cacheFind(const std::string &key) {
+        CacheShard &shard = cacheShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.index.find(key);
+        if (found == shard.index.end()) return nullptr;
+        shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+        return found->second->file;
+    }
+
+    void cacheInsert(const std::string &key, std::shared_ptr<const std::vector<uint8_t>> file) {
+        CacheShard &shard = cacheShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (file->size() > shard.capacity) return;
+        auto found = shard.index.find(key);
+        if (found != shard.index.end()) {
+            // Rendered by another thread meanwhile; the images are the same.
+            shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+            return;
         }
+        shard.entries.push_front(CacheEntry{key, file});
+        shard.index[key] = shard.entries.begin();
+        shard.bytes += file->size();
+        evict(shard);
+    }
 
-        info.width = 88;  // padding, divisible by 4
-        info.height = 78;
-        info.bytesWidth = info.width * info.channels * (info.bitDepth / 8);
-        initImage(info, data);
-        int linePos = 9; // Space padding
+#ifdef BARGENLIB_POSIX
+    // The disk cache, see openDiskCache(). The blob file is a sequence of
+    // records (a DiskRecord, the key, then the image file) that only grows.
+    // The index file is a DiskIndexHeader and then an open-addressing table
+    // of DiskSlots. Writers append a record and then publish it by storing
+    // its slot's location and hash, in that order, under a mutex and a flock
+    // shared with other processes. Readers take no locks: they follow the
+    // hash, and check the record's key and CRC before trusting it. Records
+    // are never rewritten, so each process checks a slot's CRC once, when it
+    // writes or first reads the record, and remembers the location it
+    // checked.
+    const char DiskIndexMagic[8] = {'B', 'G', 'L', 'I', 'D', 'X', '0', '1'};
+    const int DiskMaxProbes = 64;
 
-        // Add guard patterns and numbers.
-        writeGuardUPC(info, data, linePos, S);
-        for (int n = 0; n < 4; n++) {
-            writeNumUPC(info, data, linePos, code[n], L);
+    struct DiskIndexHeader {
+        char magic[8];
+        std::uint64_t slots;
+        std::atomic<std::uint64_t> blobSize;  // bytes of complete records in the blob
+        char reserved[40];
+    };
+
+    struct DiskSlot {
+        std::atomic<std::uint64_t> hash;      // 0 for empty slots
+        std::atomic<std::uint64_t> location;  // record offset << 24 | record size
+    };
+
+    struct DiskRecord {
+        uint32_t keySize;
+        uint32_t fileSize;
+        uint32_t crc;
+    };
+
+    static_assert(sizeof(DiskIndexHeader) == 64, "the index header is 64 bytes");
+    static_assert(sizeof(DiskSlot) == 16, "index slots are 16 bytes");
+
+    class DiskCache {
+    public:
+        DiskCache() : blobFd(-1), indexFd(-1), blob(nullptr), blobCapacity(0), header(nullptr),
+                slots(nullptr), slotMask(0), indexBytes(0), verified(nullptr) {}
+
+        bool open(const std::string &directory, std::size_t maxBytes, std::size_t slotCount) {
+            blobFd = ::open((directory + "/bargenlib.blob").c_str(), O_RDWR | O_CREAT, 0644);
+            indexFd = ::open((directory + "/bargenlib.index").c_str(), O_RDWR | O_CREAT, 0644);
+            if (blobFd < 0 || indexFd < 0 || flock(indexFd, LOCK_EX) != 0) return false;
+            bool mapped = mapIndex(slotCount) && mapBlob(maxBytes);
+            flock(indexFd, LOCK_UN);
+            return mapped;
         }
-        writeGuardUPC(info, data, linePos, M);
-        for (int n = 4; n < code.size(); n++) {
-            writeNumUPC(info, data, linePos, code[n], R);
+
+        void close() {
+            if (blob) munmap(const_cast<uint8_t*>(blob), blobCapacity);
+            if (header) munmap(header, indexBytes);
+            if (verified) munmap(verified, (slotMask + 1) * sizeof(std::atomic<std::uint64_t>));
+            if (blobFd >= 0) ::close(blobFd);
+            if (indexFd >= 0) ::close(indexFd);
+            blobFd = indexFd = -1;
+            blob = nullptr;
+            header = nullptr;
+            slots = nullptr;
+            verified = nullptr;
         }
 
-        // Add check digit, if neccessary
-        if (code.size() == 7) {
-            int remainder = ((3 * (code[0] + code[2] + code[4] + code[6])
-                                    + (code[1] + code[3] + code[5])) % 10);
-            int checkDigit = (10 - remainder) % 10;
-            writeNumUPC(info, data, linePos, checkDigit, R);
+        bool find(const std::string &key, std::vector<uint8_t> &file) const {
+            const uint8_t *record = lookup(key);
+            if (!record) return false;
+            DiskRecord info = recordHeader(record);
+            const uint8_t *bytes = record + sizeof(DiskRecord) + info.keySize;
+            file.assign(bytes, bytes + info.fileSize);
+            return true;
         }
 
-        // Add end guard pattern
-        writeGuardUPC(info, data, linePos, E);
-    }
+        // Records are never rewritten, so the region stays valid until close().
+        bool region(const std::string &key, FileRegion &region) const {
+            const uint8_t *record = lookup(key);
+            if (!record) return false;
+            DiskRecord info = recordHeader(record);
+            region.fd = blobFd;
+            region.offset = (record - blob) + sizeof(DiskRecord) + info.keySize;
+            region.size = info.fileSize;
+            return true;
+        }
 
-    void encodeEAN13(ImageInfo &info, std::vector<uint8_t> &data, const std::vector<int> &code) {
-        if (code.size() != 12 && code.size() != 13) {
-            throw std::runtime_error("A valid EAN-13 code must be 12-13 digits.");
+        void insert(const std::string &key, const std::vector<uint8_t> &file) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (flock(indexFd, LOCK_EX) != 0) return;
+            std::uint64_t index;
+            DiskSlot *slot = freeSlot(key, index);
+            std::uint64_t offset = header->blobSize.load(std::memory_order_relaxed);
+            std::uint64_t size = sizeof(DiskRecord) + key.size() + file.size();
+            if (slot && size < (1u << 24) && offset + size <= blobCapacity) {
+                DiskRecord info = {static_cast<uint32_t>(key.size()), static_cast<uint32_t>(file.size()),
+                        lodepng_crc32(file.data(), file.size())};
+                std::vector<uint8_t> record(reinterpret_cast<const uint8_t*>(&info),
+                        reinterpret_cast<const uint8_t*>(&info) + sizeof(info));
+                record.insert(record.end(), key.begin(), key.end());
+                record.insert(record.end(), file.begin(), file.end());
+                if (pwrite(blobFd, record.data(), record.size(), offset) == static_cast<ssize_t>(record.size())) {
+                    header->blobSize.store(offset + size, std::memory_order_release);
+                    slot->location.store(offset << 24 | size, std::memory_order_relaxed);
+                    slot->hash.store(hashKey(key), std::memory_order_release);
+                    verified[index].store(offset << 24 | size, std::memory_order_relaxed);
+                }
+            }
+            flock(indexFd, LOCK_UN);
         }
-        for (int n : code) {
-            if (n < 0 || n > 9) throw std::runtime_error("An EAN-13 digit must be 0-9.");
+
+    private:
+        // FNV-1a, with 0 kept for empty slots.
+        static std::uint64_t hashKey(const std::string &key) {
+            std::uint64_t hash = 14695981039346656037ull;
+            for (char c : key) hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+            return hash ? hash : 1;
         }
 
-        info.width = 116;  // padding, divisible by 4
-        info.height = 78;
-        info.bytesWidth = info.width * info.channels * (info.bitDepth / 8);
-        initImage(info, data);
-        int linePos = 9; // Space padding
+        // The record stored for key, after checking its CRC, or null.
+        const uint8_t *lookup(const std::string &key) const {
+            std::uint64_t hash = hashKey(key);
+            for (int probe = 0; probe < DiskMaxProbes; probe++) {
+                std::uint64_t index = (hash + probe) & slotMask;
+                const DiskSlot &slot = slots[index];
+                std::uint64_t slotHash = slot.hash.load(std::memory_order_acquire);
+                if (slotHash == 0) return nullptr;
+                if (slotHash != hash) continue;
+                std::uint64_t location = slot.location.load(std::memory_order_relaxed);
+                const uint8_t *record = this->record(location);
+                if (!record || recordKey(record) != key) continue;
+                if (verified[index].load(std::memory_order_relaxed) == location) return record;
+                if (!intact(record)) return nullptr;
+                verified[index].store(location, std::memory_order_relaxed);
+                return record;
+            }
+            return nullptr;
+        }
 
-        // Add guard patterns and numbers.
-        writeGuardUPC(info, data, linePos, S);
-        for (int n = 1; n < 7; n++) {
-            // Determine parity type, G (even) or L (odd), then write
-            BarRegion region = (EanParityPattern[code[0]] << (n-1)) & (0b100000) ? G : L;
-            writeNumUPC(info, data, linePos, code[n], region);
+        // Whether a record's image matches its CRC.
+        static bool intact(const uint8_t *record) {
+            DiskRecord info = recordHeader(record);
+            const uint8_t *bytes = record + sizeof(DiskRecord) + info.keySize;
+            return lodepng_crc32(bytes, info.fileSize) == info.crc;
         }
-        writeGuardUPC(info, data, linePos, M);
-        for (int n = 7; n < code.size(); n++) {
-            writeNumUPC(info, data, linePos, code[n], R);
+
+        bool mapIndex(std::size_t slotCount) {
+            struct stat info;
+            if (fstat(indexFd, &info) != 0) return false;
+            DiskIndexHeader empty;
+            if (info.st_size == 0) {
+                // A new index: round the slots up to a power of two.
+                std::uint64_t count = 1;
+                while (count < slotCount) count <<= 1;
+                std::memcpy(empty.magic, DiskIndexMagic, sizeof(empty.magic));
+                empty.slots = count;
+                empty.blobSize.store(0, std::memory_order_relaxed);
+                std::memset(empty.reserved, 0, sizeof(empty.reserved));
+                if (pwrite(indexFd, &empty, sizeof(empty), 0) != sizeof(empty)) return false;
+                if (ftruncate(indexFd, sizeof(DiskIndexHeader) + count * sizeof(DiskSlot)) != 0) return false;
+            } else if (pread(indexFd, &empty, sizeof(empty), 0) != sizeof(empty)
+                    || std::memcmp(empty.magic, DiskIndexMagic, sizeof(empty.magic)) != 0
+                    || empty.slots == 0 || (empty.slots & (empty.slots - 1)) != 0
+                    || static_cast<std::uint64_t>(info.st_size) != sizeof(DiskIndexHeader) + empty.slots * sizeof(DiskSlot)) {
+                return false;
+            }
+            indexBytes = sizeof(DiskIndexHeader) + empty.slots * sizeof(DiskSlot);
+            void *index = mmap(nullptr, indexBytes, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+            if (index == MAP_FAILED) return false;
+            header = static_cast<DiskIndexHeader*>(index);
+            slots = reinterpret_cast<DiskSlot*>(header + 1);
+            slotMask = empty.slots - 1;
+            // Zero pages, so only slots that are looked up take memory.
+            void *checked = mmap(nullptr, empty.slots * sizeof(std::atomic<std::uint64_t>), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (checked == MAP_FAILED) return false;
+            verified = static_cast<std::atomic<std::uint64_t>*>(checked);
+            return true;
         }
 
-        // Add check digit, if neccessary
-        if (code.size() == 12) {
-            int remainder = ((3 * (code[1] + code[3] + code[5] + code[7] + code[9] + code[11])
-                            + (code[0] + code[2] + code[4] + code[6] + code[8] + code[10])) % 10);
-            int checkDigit = (10 - remainder) % 10;
-            writeNumUPC(info, data, linePos, checkDigit, R);
+        // Maps maxBytes of the blob up front, so it never has to be remapped
+        // while readers use it. Pages past the end of the file are only read
+        // after records were written there.
+        bool mapBlob(std::size_t maxBytes) {
+            struct stat info;
+            if (fstat(blobFd, &info) != 0) return false;
+            // After a crash, records the index points to may not have reached
+            // the disk. Start over then, rather than keep slots that can't hit.
+            std::uint64_t size = header->blobSize.load(std::memory_order_relaxed);
+            if (size > static_cast<std::uint64_t>(info.st_size)) {
+                for (std::uint64_t i = 0; i <= slotMask; i++) slots[i].hash.store(0, std::memory_order_relaxed);
+                header->blobSize.store(0, std::memory_order_relaxed);
+                if (ftruncate(blobFd, 0) != 0) return false;
+            }
+            blobCapacity = maxBytes;
+            void *mapping = mmap(nullptr, blobCapacity, PROT_READ, MAP_SHARED, blobFd, 0);
+            if (mapping == MAP_FAILED) return false;
+            blob = static_cast<const uint8_t*>(mapping);
+            return true;
         }
 
-        // Add end guard pattern (4 cols)
-        writeGuardUPC(info, data, linePos, E);
-    }
+        // The record at a slot's location, or null if it does not fit the blob.
+        const uint8_t *record(std::uint64_t location) const {
+            std::uint64_t offset = location >> 24;
+            std::uint64_t size = location & 0xFFFFFF;
+            std::uint64_t end = std::min<std::uint64_t>(header->blobSize.load(std::memory_order_acquire), blobCapacity);
+            if (size < sizeof(DiskRecord) || offset > end || size > end - offset) return nullptr;
+            DiskRecord info = recordHeader(blob + offset);
+            if (sizeof(DiskRecord) + static_cast<std::uint64_t>(info.keySize) + info.fileSize != size) return nullptr;
+            return blob + offset;
+        }
 
-    void encodeUPCA(ImageInfo &info, std::vector<uint8_t> &data, const std::vector<int> &code) {
-        if (code.size() != 11 && code.size() != 12) {
-            throw std::invalid_argument("A valid UPC-A code must be 11 or 12 digits.");
+        // Records follow each other unaligned, so their headers are copied out.
+        static DiskRecord recordHeader(const uint8_t *record) {
+            DiskRecord info;
+            std::memcpy(&info, record, sizeof(info));
+            return info;
         }
-        for (int n : code) {
-            if (n < 0 || n > 9) throw std::invalid_argument("A UPC-A digit must be 0-9.");
+
+        static std::string recordKey(const uint8_t *record) {
+            DiskRecord info = recordHeader(record);
+            return std::string(reinterpret_cast<const char*>(record + sizeof(DiskRecord)), info.keySize);
         }
-        // UPC-A is equivalent to EAN-13 with international code 0.
-        std::vector<int> eanCode(code);
-        std::vector<int>::iterator iterator;
-        iterator = eanCode.begin();
-        eanCode.insert(iterator, 0);
-        encodeEAN13(info, data, eanCode);
+
+        // The slot to store key in, or null if it is already stored (by
+        // another process, say) or its probe sequence is full. A slot whose
+        // record for key fails its CRC is returned too, so a new record
+        // replaces it rather than the key never being cached again.
+        DiskSlot *freeSlot(const std::string &key, std::uint64_t &index) {
+            std::uint64_t hash = hashKey(key);
+            for (int probe = 0; probe < DiskMaxProbes; probe++) {
+                index = (hash + probe) & slotMask;
+                DiskSlot &slot = slots[index];
+                std::uint64_t slotHash = slot.hash.load(std::memory_order_acquire);
+                if (slotHash == 0) return &slot;
+                if (slotHash != hash) continue;
+                std::uint64_t location = slot.location.load(std::memory_order_relaxed);
+                const uint8_t *record = this->record(location);
+                if (!record || recordKey(record) != key) continue;
+                return (verified[index].load(std::memory_order_relaxed) == location || intact(record)) ? nullptr : &slot;
+            }
+            return nullptr;
+        }
+
+        int blobFd;
+        int indexFd;
+        const uint8_t *blob;
+        std::size_t blobCapacity;
+        DiskIndexHeader *header;
+        DiskSlot *slots;
+        std::uint64_t slotMask;
+        std::size_t indexBytes;
+        std::atomic<std::uint64_t> *verified;  // per slot, the location whose CRC this process checked
+        std::mutex mutex;
+    };
+
+    DiskCache Disk;
+#endif
+    std::atomic<bool> DiskCacheOpen(false);
+    std::atomic<std::uint64_t> DiskHits(0);
+    std::atomic<std::uint64_t> DiskMisses(0);
+
+    bool diskCacheFind(const std::string &key, std::vector<uint8_t> &file) {
+#ifdef BARGENLIB_POSIX
+        return Disk.find(key, file);
+#else
+        (void)key;
+        (void)file;
+        return false;
+#endif
     }
+
+    bool diskCacheRegion(const std::string &key, FileRegion &region) {
+#ifdef BARGENLIB_POSIX
+        return Disk.region(key, region);
+#else
+        (void)key;
+        (void)region;
+        return false;
+#endif
     }
 
-void save(const std::vector<int> &code, const std::string &path,
-        Encoding codeType, FileType fileType) {
-    ImageInfo *info;
-    switch (fileType) {
-        case PNG_A:
-            info = &ImageInfo(fileType, 0, 0, 0, true, 8, 2);
-            break;
-        case PNG:
-        case BMP:
-        default:
-            info = &ImageInfo(fileType, 0, 0, 0, false, 8, 1);
-            break;
+    void diskCacheInsert(const std::string &key, const std::vector<uint8_t> &file) {
+#ifdef BARGENLIB_POSIX
+        Disk.insert(key, file);
+#else
+        (void)key;
+        (void)file;
+#endif
     }
-    std::vector<uint8_t> data;
-    switch (codeType) {
-        case EAN_8:
-            encodeEAN8(*info, data, code);
-            break;
-        case EAN_13:
-            encodeEAN13(*info, data, code);
-            break;
-        case UPC_A:
-        default:
-            encodeUPCA(*info, data, code);
-            break;
+
+    // Archive files, see ArchiveWriter: ArchiveMagic, the images, the index,
+    // then a trailer of the index offset, the entry count and ArchiveIndexMagic.
+    // An index entry is the encoding, the file type, the number of digits, the
+    // digits, then the image's offset (8 bytes) and size (4 bytes). Numbers
+    // are little-endian.
+    const char ArchiveMagic[8] = {'B', 'G', 'L', 'A', 'R', 'C', '0', '1'};
+    const char ArchiveIndexMagic[8] = {'B', 'G', 'L', 'A', 'I', 'D', 'X', '1'};
+    const std::size_t ArchiveTrailerSize = 24;
+
+    void putLE(std::vector<uint8_t> &out, std::uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; i++) out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+
+    std::uint64_t getLE(const uint8_t *in, int bytes) {
+        std::uint64_t value = 0;
+        for (int i = 0; i < bytes; i++) value |= static_cast<std::uint64_t>(in[i]) << (8 * i);
+        return value;
+    }
+
+    // Bundles, see BundleWriter. Tar entries are a 512 byte ustar header and
+    // the file padded to 512 bytes, and the bundle ends with two empty blocks.
+    // Zip entries are a local header and the stored file; finish() writes the
+    // central directory, with zip64 records once a count or offset overflows.
+    const std::size_t TarBlock = 512;
+    const std::uint64_t Zip32Max = 0xFFFFFFFF;
+
+    // Writes value as a zero-terminated octal number filling field.
+    void putOctal(char *field, std::size_t size, std::uint64_t value) {
+        field[size - 1] = '\0';
+        for (std::size_t i = size - 1; i > 0; i--) {
+            field[i - 1] = static_cast<char>('0' + (value & 7));
+            value >>= 3;
+        }
+    }
+
+    std::vector<uint8_t> tarHeader(const std::string &name, std::uint64_t size, std::time_t time) {
+        // Names over 100 bytes are split at a '/' into the prefix field.
+        std::size_t split = 0;
+        if (name.size() > 100) {
+            split = name.rfind('/', 155);
+            if (split == std::string::npos || name.size() - split - 1 > 100 || split == 0) {
+                throw std::runtime_error("The name " + name + " is too long for a tar bundle.");
+            }
+        }
+        std::vector<uint8_t> header(TarBlock, 0);
+        char *block = reinterpret_cast<char*>(header.data());
+        if (split) {
+            name.copy(block + 345, split);
+            name.copy(block, std::string::npos, split + 1);
+        } else {
+            name.copy(block, 100);
+        }
+        putOctal(block + 100, 8, 0644);            // mode
+        putOctal(block + 108, 8, 0);               // uid
+        putOctal(block + 116, 8, 0);               // gid
+        putOctal(block + 124, 12, size);
+        putOctal(block + 136, 12, static_cast<std::uint64_t>(time));
+        block[156] = '0';                          // a regular file
+        std::memcpy(block + 257, "ustar\0" "00", 8);
+        // The checksum is summed with its own field as spaces.
+        std::memset(block + 148, ' ', 8);
+        unsigned checksum = 0;
+        for (uint8_t byte : header) checksum += byte;
+        putOctal(block + 148, 7, checksum);
+        return header;
     }
-    writeImage(*info, data, path, fileType);
+
+    struct ZipEntry {
+        std::string name;
+        uint32_t crc;
+        uint32_t size;
+        std::uint64_t offset;
+    };
+
+    // MS-DOS date and time, as zip stores them.
+    // std::localtime() returns a shared buffer, so BundleWriters on different
+    // threads use the reentrant versions, or take turns where there are none.
+    uint32_t dosTime(std::time_t time) {
+        std::tm result;
+        std::tm *local = &result;
+#if defined(BARGENLIB_POSIX)
+        if (!localtime_r(&time, &result)) local = nullptr;
+#elif defined(_WIN32)
+        if (localtime_s(&result, &time) != 0) local = nullptr;
+#else
+        static std::mutex LocalTimeMutex;
+        {
+            std::lock_guard<std::mutex> lock(LocalTimeMutex);
+            std::tm *shared = std::localtime(&time);
+            if (shared) result = *shared;
+            else local = nullptr;
+        }
+#endif
+        if (!local || local->tm_year < 80) return (1 << 21) | (1 << 16);  // 1980-01-01
+        return static_cast<uint32_t>(((local->tm_year - 80) << 25) | ((local->tm_mon + 1) << 21)
+                | (local->tm_mday << 16) | (local->tm_hour << 11) | (local->tm_min << 5) | (local->tm_sec / 2));
+    }
+
+    // A file waiting for or being written by an AsyncWriter.
+    struct WriteJob {
+        std::string path;
+        std::vector<uint8_t> file;
+        int fd = -1;
+        std::size_t written = 0;
+        int error = 0;
+        int stage = 0;  // for io_uring: the operation in flight
+    };
+
+    // Writes a job's file with blocking calls, returning 0 or an errno value.
+    int writeJob(const WriteJob &job) {
+#ifdef BARGENLIB_POSIX
+        int fd = ::open(job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return errno;
+        int error = 0;
+        std::size_t written = 0;
+        while (written < job.file.size() && !error) {
+            ssize_t size = pwrite(fd, job.file.data() + written, job.file.size() - written, written);
+            if (size > 0) written += size;
+            else if (size == 0) error = EIO;
+            else if (errno != EINTR) error = errno;
+        }
+        if (::close(fd) != 0 && !error) error = errno;
+        return error;
+#else
+        std::ofstream out(job.path, std::ios_base::binary | std::ios_base::trunc);
+        out.write(reinterpret_cast<const char*>(job.file.data()), job.file.size());
+        out.close();
+        return out ? 0 : EIO;
+#endif
+    }
+
+    // The fallback of AsyncWriter: threads taking jobs from a queue.
+    class WritePool {
+    public:
+        WritePool(std::size_t depth, int threads) : depth(depth), pending(0), stop(false) {
+            for (int i = 0; i < std::max(threads, 1); i++) workers.emplace_back(&WritePool::work, this);
+        }
+
+        ~WritePool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            workAvailable.notify_all();
+            for (std::thread &worker : workers) worker.join();
+        }
+
+        void submit(WriteJob &&job) {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobDone.wait(lock, [this]() { return pending < depth; });
+            queue.push_back(std::move(job));
+            pending++;
+            lock.unlock();
+            workAvailable.notify_one();
+        }
+
+        std::vector<WriteError> wait() {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobDone.wait(lock, [this]() { return pending == 0; });
+            std::vector<WriteError> result;
+            result.swap(errors);
+            return result;
+        }
+
+    private:
+        void work() {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                workAvailable.wait(lock, [this]() { return stop || !queue.empty(); });
+                if (queue.empty()) return;
+                WriteJob job = std::move(queue.front());
+                queue.pop_front();
+                lock.unlock();
+                int error = writeJob(job);
+                lock.lock();
+                if (error) errors.push_back(WriteError{job.path, error});
+                pending--;
+                jobDone.notify_all();
+            }
+        }
+
+        std::size_t depth;
+        std::size_t pending;  // queued or being written
+        bool stop;
+        std::mutex mutex;
+        std::condition_variable workAvailable;
+        std::condition_variable jobDone;
+        std::deque<WriteJob> queue;
+        std::vector<WriteError> errors;
+        std::vector<std::thread> workers;
+    };
+
+#ifdef BARGENLIB_IO_URING
+    // AsyncWriter on io_uring. Each job has one operation in flight at a time:
+    // openat, then writes until the file is written, then close, with the
+    // job's slot as the user data. New operations are queued in the ring and
+    // submitted in batches, and completions are reaped from the ring without
+    // system calls where possible. If io_uring_enter fails for good, the
+    // jobs in flight fail with its errno and the ring takes no new jobs.
+    class WriteRing {
+    public:
+        WriteRing() : fd(-1), ring(MAP_FAILED), ringBytes(0), sqes(nullptr), sqeBytes(0), queued(0), failure(0) {}
+
+        // Jobs given up on by fail() keep their buffers until the ring is
+        // closed, since the kernel may still be using them.
+        ~WriteRing() {
+            if (failure) reap();
+            if (sqes) munmap(sqes, sqeBytes);
+            if (ring != MAP_FAILED) munmap(ring, ringBytes);
+            if (fd >= 0) ::close(fd);
+            for (WriteJob &job : jobs) {
+                if (job.fd >= 0 && job.stage != IORING_OP_CLOSE) ::close(job.fd);
+            }
+        }
+
+        bool open(std::size_t depth) {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            fd = static_cast<int>(syscall(__NR_io_uring_setup, static_cast<unsigned>(depth), &params));
+            if (fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) || !supported()) return false;
+            ringBytes = std::max<std::size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                    params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+            ring = mmap(nullptr, ringBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            if (ring == MAP_FAILED) return false;
+            sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+            void *entries = mmap(nullptr, sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQES);
+            if (entries == MAP_FAILED) return false;
+            sqes = static_cast<io_uring_sqe*>(entries);
+            char *base = static_cast<char*>(ring);
+            sqHead = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+            sqTail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+            sqMask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+            sqArray = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+            cqHead = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+            cqTail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+            cqMask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+            // One operation per job, so the submission queue never overflows;
+            // the kernel rounds sq_entries up to a power of two, but no more
+            // than depth files are in flight.
+            jobs.resize(std::min<std::size_t>(depth, params.sq_entries));
+            for (std::size_t i = jobs.size(); i > 0; i--) freeSlots.push_back(i - 1);
+            return true;
+        }
+
+        // Takes the job, or returns false and leaves it alone if the ring has
+        // failed.
+        bool submit(WriteJob &job) {
+            while (freeSlots.empty() && !failure) {
+                enter(1);
+                reap();
+            }
+            if (failure) return false;
+            std::size_t slot = freeSlots.back();
+            freeSlots.pop_back();
+            jobs[slot] = std::move(job);
+            next(slot, IORING_OP_OPENAT);
+            reap();
+            if (queued >= std::max<std::size_t>(jobs.size() / 4, 1)) enter(0);
+            return true;
+        }
+
+        std::vector<WriteError> wait() {
+            while (freeSlots.size() < jobs.size() && !failure) {
+                enter(1);
+                reap();
+            }
+            std::vector<WriteError> result;
+            result.swap(errors);
+            return result;
+        }
+
+        bool failed() const {
+            return failure != 0;
+        }
+
+    private:
+        // Checks the kernel has the operations used here (openat and close
+        // need Linux 5.6).
+        bool supported() {
+            std::vector<char> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+            io_uring_probe *probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+            if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+            for (int op : {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE}) {
+                if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+            }
+            return true;
+        }
+
+        // Queues the job's next operation.
+        void next(std::size_t slot, int opcode) {
+            WriteJob &job = jobs[slot];
+            unsigned tail = *sqTail;
+            io_uring_sqe &sqe = sqes[tail & sqMask];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = static_cast<uint8_t>(opcode);
+            sqe.user_data = slot;
+            if (opcode == IORING_OP_OPENAT) {
+                sqe.fd = AT_FDCWD;
+                sqe.addr = reinterpret_cast<std::uint64_t>(job.path.c_str());
+                sqe.len = 0644;
+                sqe.open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+            } else if (opcode == IORING_OP_WRITE) {
+                sqe.fd = job.fd;
+                sqe.addr = reinterpret_cast<std::uint64_t>(job.file.data() + job.written);
+                sqe.len = static_cast<uint32_t>(std::min<std::size_t>(job.file.size() - job.written, 1u << 30));
+                sqe.off = job.written;
+            } else {
+                sqe.fd = job.fd;
+            }
+            job.stage = opcode;
+            sqArray[tail & sqMask] = tail & sqMask;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+            queued++;
+        }
+
+        // Submits the queued operations and waits for minComplete completions.
+        void enter(unsigned minComplete) {
+            for (;;) {
+                long submitted = syscall(__NR_io_uring_enter, fd, static_cast<unsigned>(queued), minComplete,
+                        minComplete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+                if (submitted >= 0) {
+                    queued -= std::min<std::size_t>(queued, submitted);
+                    return;
+                }
+                if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                    fail(errno);
+                    return;
+                }
+                if (errno != EINTR) reap();
+            }
+        }
+
+        // Gives up on the ring: every job in flight fails with the error. A
+        // job whose operation the kernel never took is released now, closing
+        // its file. The others stay in their slots, since the kernel may
+        // still use their buffers, until reap() sees their operation
+        // complete or the ring is closed.
+        void fail(int error) {
+            failure = error;
+            std::vector<bool> idle(jobs.size(), false);
+            for (std::size_t slot : freeSlots) idle[slot] = true;
+            std::vector<bool> unsubmitted(jobs.size(), false);
+            unsigned tail = *sqTail;
+            for (unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE); head != tail; head++) {
+                unsubmitted[static_cast<std::size_t>(sqes[sqArray[head & sqMask]].user_data)] = true;
+            }
+            for (std::size_t slot = 0; slot < jobs.size(); slot++) {
+                if (idle[slot]) continue;
+                if (unsubmitted[slot]) {
+                    if (jobs[slot].fd >= 0) ::close(jobs[slot].fd);
+                    finish(slot, error);
+                } else {
+                    errors.push_back(WriteError{jobs[slot].path, error});
+                }
+            }
+            queued = 0;
+        }
+
+        // Handles the completed operations, queueing each job's next one.
+        // After fail(), it only releases the jobs, closing their files.
+        void reap() {
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++) {
+                const io_uring_cqe &cqe = cqes[head & cqMask];
+                std::size_t slot = static_cast<std::size_t>(cqe.user_data);
+                WriteJob &job = jobs[slot];
+                int result = cqe.res;
+                if (failure) {
+                    if (job.stage == IORING_OP_OPENAT && result >= 0) ::close(result);
+                    else if (job.stage == IORING_OP_WRITE) ::close(job.fd);
+                    jobs[slot] = WriteJob();
+                    freeSlots.push_back(slot);
+                } else if (job.stage == IORING_OP_OPENAT) {
+                    if (result < 0) {
+                        finish(slot, -result);
+                    } else {
+                        job.fd = result;
+                        next(slot, job.file.empty() ? IORING_OP_CLOSE : IORING_OP_WRITE);
+                    }
+                } else if (job.stage == IORING_OP_WRITE) {
+                    if (result > 0) job.written += result;
+                    else job.error = result < 0 ? -result : EIO;
+                    next(slot, (job.error || job.written == job.file.size()) ? IORING_OP_CLOSE : IORING_OP_WRITE);
+                } else {
+                    finish(slot, job.error ? job.error : (result < 0 ? -result : 0));
+                }
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+
+        void finish(std::size_t slot, int error) {
+            if (error) errors.push_back(WriteError{jobs[slot].path, error});
+            jobs[slot] = WriteJob();
+            freeSlots.push_back(slot);
+        }
+
+        int fd;
+        void *ring;
+        std::size_t ringBytes;
+        io_uring_sqe *sqes;
+        std::size_t sqeBytes;
+        unsigned *sqHead;
+        unsigned *sqTail;
+        unsigned sqMask;
+        unsigned *sqArray;
+        unsigned *cqHead;
+        unsigned *cqTail;
+        unsigned cqMask;
+        io_uring_cqe *cqes;
+        std::size_t queued;  // operations not submitted yet
+        int failure;  // errno of the failed io_uring_enter, or 0
+        std::vector<WriteJob> jobs;
+        std::vector<std::size_t> freeSlots;
+        std::vector<WriteError> errors;
+    };
+#endif
+
+    // Creates a directory, which may already exist.
+    void makeDirectory(const std::string &path) {
+#ifdef BARGENLIB_POSIX
+        if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error("Could not create the directory " + path + ": " + std::strerror(errno) + ".");
+        }
+#else
+        (void)path;
+        throw std::runtime_error("Creating directories is not supported on this platform.");
+#endif
+    }
+
+    // Creates root and fanOut subdirectories in it, levels deep.
+    void makeShards(const std::string &root, int fanOut, int levels, int width) {
+        makeDirectory(root);
+        if (levels == 0) return;
+        for (int i = 0; i < fanOut; i++) {
+            std::string name = std::to_string(i);
+            makeShards(root + "/" + std::string(width - name.size(), '0') + name, fanOut, levels - 1, width);
+        }
+    }
+
+#ifdef BARGENLIB_RING
+    // The ring of RingWriter: a memfd holding a RingHeader, then the slots,
+    // each a RingSlot followed by room for slotSize bytes of image, padded to
+    // 64 bytes. Images are numbered in push order, and image p goes in slot
+    // p % slots. A slot's sequence says what it holds: p when it is free for
+    // image p, p + 1 once the writer put image p in it, and p + slots once a
+    // reader copied that out. Readers claim images by advancing readPos.
+    // published and consumed count pushes and pops; they are the futex words
+    // readers and the writer wait on, and the waiting counts let the other
+    // side skip the wake-up call when nobody waits.
+    const char RingMagic[8] = {'B', 'G', 'L', 'R', 'I', 'N', 'G', '1'};
+
+    struct RingHeader {
+        char magic[8];
+        std::uint64_t slots;
+        std::uint64_t slotSize;
+        std::atomic<uint32_t> closed;
+        std::atomic<uint32_t> writerWaiting;
+        char writerPad[32];
+        // Written by readers, so on a cache line of their own.
+        std::atomic<std::uint64_t> readPos;
+        std::atomic<uint32_t> published;
+        std::atomic<uint32_t> consumed;
+        std::atomic<uint32_t> readersWaiting;
+        char readerPad[44];
+    };
+
+    struct RingSlot {
+        std::atomic<std::uint64_t> sequence;
+        uint32_t size;
+        uint8_t codeType;
+        uint8_t fileType;
+        uint8_t digits;
+        uint8_t reserved;
+        uint8_t code[48];
+    };
+
+    static_assert(sizeof(RingHeader) == 128, "the ring header is 128 bytes");
+    static_assert(sizeof(RingSlot) == 64, "ring slot headers are 64 bytes");
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex words are plain 32-bit words");
+
+    std::uint64_t monotonicMs() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<std::uint64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+    }
+
+    // Sleeps while word still holds seen, at most until deadline (0: none).
+    // Returns false once the deadline passed.
+    bool futexWait(std::atomic<uint32_t> &word, uint32_t seen, std::uint64_t deadline) {
+        timespec timeout = {0, 0};
+        if (deadline) {
+            std::uint64_t now = monotonicMs();
+            if (now >= deadline) return false;
+            timeout.tv_sec = static_cast<time_t>((deadline - now) / 1000);
+            timeout.tv_nsec = static_cast<long>((deadline - now) % 1000) * 1000000;
+        }
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, seen, deadline ? &timeout : nullptr,
+                nullptr, 0);
+        return true;
+    }
+
+    void futexWake(std::atomic<uint32_t> &word, int count) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, count, nullptr, nullptr, 0);
+    }
+
+    // A ring mapped into this process, by its writer or a reader.
+    struct RingMapping {
+        RingHeader *header = nullptr;
+        uint8_t *slots = nullptr;
+        std::uint64_t mask = 0;
+        std::uint64_t slotSize = 0;
+        std::size_t stride = 0;
+        std::size_t bytes = 0;
+
+        static std::size_t strideFor(std::uint64_t slotSize) {
+            return sizeof(RingSlot) + static_cast<std::size_t>((slotSize + 63) & ~std::uint64_t(63));
+        }
+
+        // Maps the ring in fd, checking that its header matches the file.
+        bool map(int fd) {
+            struct stat info;
+            RingHeader copy;
+            if (fstat(fd, &info) != 0 || pread(fd, &copy, sizeof(copy), 0) != sizeof(copy)
+                    || std::memcmp(copy.magic, RingMagic, sizeof(RingMagic)) != 0
+                    || copy.slots == 0 || (copy.slots & (copy.slots - 1)) != 0 || copy.slots > (1u << 20)
+                    || copy.slotSize == 0 || copy.slotSize > (1u << 30)) {
+                return false;
+            }
+            slotSize = copy.slotSize;
+            stride = strideFor(copy.slotSize);
+            bytes = sizeof(RingHeader) + copy.slots * stride;
+            if (static_cast<std::uint64_t>(info.st_size) != bytes) return false;
+            void *mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mapping == MAP_FAILED) return false;
+            header = static_cast<RingHeader*>(mapping);
+            slots = static_cast<uint8_t*>(mapping) + sizeof(RingHeader);
+            mask = copy.slots - 1;
+            return true;
+        }
+
+        void unmap() {
+            if (header) munmap(header, bytes);
+            header = nullptr;
+        }
+
+        RingSlot &slot(std::uint64_t position) const {
+            return *reinterpret_cast<RingSlot*>(slots + (position & mask) * stride);
+        }
+    };
+#endif
+
+    int checkDigit(const int *code, std::size_t size) {
+        // Digits are weighted 3 and 1 alternately, starting with 3 at the right.
+        int sum = 0;
+        for (std::size_t i = 0; i < size; i++) {
+            sum += ((size - i) % 2) ? 3 * code[i] : code[i];
+        }
+        return (10 - sum % 10) % 10;
+    }
+
+    void encodeEAN8(ImageInfo &info, std::vector<uint8_t> &data, const std::vector<int> &code) {
+        BARGENLIB_STAGE(STAGE_VALIDATE);
+        if (code.size() != 7 && code.size() != 8) {
+            throw std::runtime_error("A valid EAN-8 code must be 7 or 8 digits.");
+        }
+        for (int n : code) {
+            if (n < 0 || n > 9) throw std::runtime_error("An EAN-8 digit must be 0-9.");
+        }
+
+        info.width = 88;  // padding, divisible by 4
+        info.height = 78;
+        info.bytesWidth = info.width * info.channels * (info.bitDepth / 8);
+        BARGENLIB_STAGE(STAGE_INIT_IMAGE);
+        initImage(info, data);
+        BARGENLIB_STAGE(STAGE_DRAW);
+        int linePos = 9; // Space padding
+
+        // Add guard patterns and numbers.
+        writeGuardUPC(info, data, linePos, S);
+        for (int n = 0; n < 4; n++) {
+            writeNumUPC(info, data, linePos, code[n], L);
+        }
+        writeGuardUPC(info, data, linePos, M);
+        for (int n = 4; n < code.size(); n++) {
+            writeNumUPC(info, data, linePos, code[n], R);
+        }
+
+        // Add check digit, if neccessary
+        if (code.size() == 7) {
+            writeNumUPC(info, data, linePos, checkDigit(code.data(), code.size()), R);
+        }
+
+        // Add end guard pattern
+        writeGuardUPC(info, data, linePos, E);
+        BARGENLIB_STAGE_END();
+    }
+
+    void encodeEAN13(ImageInfo &info, std::vector<uint8_t> &data, const std::vector<int> &code) {
+        BARGENLIB_STAGE(STAGE_VALIDATE);
+        if (code.size() != 12 && code.size() != 13) {
+            throw std::runtime_error("A valid EAN-13 code must be 12-13 digits.");
+        }
+        for (int n : code) {
+            if (n < 0 || n > 9) throw std::runtime_error("An EAN-13 digit must be 0-9.");
+        }
+
+        info.width = 116;  // padding, divisible by 4
+        info.height = 78;
+        info.bytesWidth = info.width * info.channels * (info.bitDepth / 8);
+        BARGENLIB_STAGE(STAGE_INIT_IMAGE);
+        initImage(info, data);
+        BARGENLIB_STAGE(STAGE_DRAW);
+        int linePos = 9; // Space padding
+
+        // Add guard patterns and numbers.
+        writeGuardUPC(info, data, linePos, S);
+        for (int n = 1; n < 7; n++) {
+            // Determine parity type, G (even) or L (odd), then write
+            BarRegion region = (EanParityPattern[code[0]] << (n-1)) & (0b100000) ? G : L;
+            writeNumUPC(info, data, linePos, code[n], region);
+        }
+        writeGuardUPC(info, data, linePos, M);
+        for (int n = 7; n < code.size(); n++) {
+            writeNumUPC(info, data, linePos, code[n], R);
+        }
+
+        // Add check digit, if neccessary
+        if (code.size() == 12) {
+            writeNumUPC(info, data, linePos, checkDigit(code.data(), code.size()), R);
+        }
+
+        // Add end guard pattern (4 cols)
+        writeGuardUPC(info, data, linePos, E);
+        BARGENLIB_STAGE_END();
+    }
+
+    void encodeUPCA(ImageInfo &info, std::vector<uint8_t> &data, const std::vector<int> &code) {
+        BARGENLIB_STAGE(STAGE_VALIDATE);
+        if (code.size() != 11 && code.size() != 12) {
+            throw std::invalid_argument("A valid UPC-A code must be 11 or 12 digits.");
+        }
+        for (int n : code) {
+            if (n < 0 || n > 9) throw std::invalid_argument("A UPC-A digit must be 0-9.");
+        }
+        // UPC-A is equivalent to EAN-13 with international code 0.
+        std::vector<int> eanCode(code);
+        std::vector<int>::iterator iterator;
+        iterator = eanCode.begin();
+        eanCode.insert(iterator, 0);
+        encodeEAN13(info, data, eanCode);
+    }
+
+    // Reads the middle row of a written image back as greyscale pixels.
+    void readPNGScanline(const ImageInfo &info, const std::string &path, std::vector<uint8_t> &pixels) {
+        std::vector<uint8_t> image;
+        unsigned width, height;
+        unsigned int error = lodepng::decode(image, width, height, path,
+                (info.hasAlpha) ? LodePNGColorType::LCT_GREY_ALPHA : LodePNGColorType::LCT_GREY, 8);
+        if (error || width == 0 || height == 0) {
+            throw std::runtime_error("Barcode verification could not read back " + path + ".");
+        }
+        // Bars are opaque in PNG_A and black in PNG.
+        if (info.hasAlpha) {
+            const uint8_t *row = &image[(height / 2) * width * 2];
+            pixels.resize(width);
+            for (unsigned x = 0; x < width; x++) pixels[x] = 255 - row[x * 2 + 1];
+        } else {
+            pixels.assign(image.begin() + (height / 2) * width, image.begin() + (height / 2 + 1) * width);
+        }
+    }
+
+    void readBMPScanline(const std::string &path, std::vector<uint8_t> &pixels) {
+        std::ifstream in(path, std::ios_base::binary);
+        BMPFileHeader fileHeader(0);
+        BMPInfoHeader infoHeader(0, 0);
+        in.read(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader));
+        in.read(reinterpret_cast<char*>(&infoHeader), sizeof(infoHeader));
+        int width = static_cast<int32_t>(infoHeader.width);
+        int height = static_cast<int32_t>(infoHeader.height);
+        if (!in || fileHeader.fileType != 0x4D42 || infoHeader.bitDepth != 8 || width <= 0 || height == 0) {
+            throw std::runtime_error("Barcode verification could not read back " + path + ".");
+        }
+        // Only the middle row is read. Rows are padded to 4 bytes, palette index 1 is black.
+        int rowSize = (width + 3) & ~3;
+        int rowCount = (height < 0) ? -height : height;
+        pixels.resize(width);
+        in.seekg(fileHeader.imageOffset + static_cast<std::streamoff>(rowCount / 2) * rowSize);
+        in.read(reinterpret_cast<char*>(pixels.data()), width);
+        if (!in) throw std::runtime_error("Barcode verification could not read back " + path + ".");
+        for (uint8_t &pixel : pixels) pixel = pixel ? 0 : 255;
+    }
+
+    void verifyImage(const ImageInfo &info, const std::vector<int> &code,
+            const std::string &path, Encoding codeType) {
+        BARGENLIB_STAGE(STAGE_VERIFY);
+        std::vector<uint8_t> pixels;
+        switch (info.fileType) {
+            case PNG:
+            case PNG_A:
+                readPNGScanline(info, path, pixels);
+                break;
+            case BMP:
+            default:
+                readBMPScanline(path, pixels);
+                break;
+        }
+
+        // The generated check digit is part of the expected code when it was left out.
+        std::vector<int> expected(code);
+        std::size_t fullSize = (codeType == EAN_8) ? 8 : (codeType == EAN_13) ? 13 : 12;
+        if (expected.size() + 1 == fullSize) expected.push_back(checkDigit(code.data(), code.size()));
+
+        Barcode barcode;
+        bool decoded = decodeScanline(pixels.data(), pixels.size(), barcode);
+        // An EAN-13 code starting with 0 decodes as UPC-A.
+        if (decoded && codeType == EAN_13 && barcode.codeType == UPC_A) {
+            barcode.codeType = EAN_13;
+            barcode.code.insert(barcode.code.begin(), 0);
+        }
+        if (!decoded || barcode.codeType != codeType || barcode.code != expected) {
+            throw std::runtime_error("Barcode verification failed: " + path
+                    + " does not decode to the given code.");
+        }
+        BARGENLIB_STAGE_END();
+    }
+
+    // Returns whether each of count runs is about as wide as the average of them,
+    // which guards are made of.
+    bool isGuard(const uint32_t *runs, int count) {
+        uint32_t sum = 0;
+        for (int i = 0; i < count; i++) sum += runs[i];
+        for (int i = 0; i < count; i++) {
+            if (2 * count * runs[i] < sum || 2 * count * runs[i] > 3 * sum) return false;
+        }
+        return true;
+    }
+
+    // Normalizes the widths of a digit's 4 runs to 7 modules and returns the index
+    // of the matching digit in DigitWidths, only looking at L digits unless withG.
+    uint8_t decodeDigit(const uint32_t *runs, bool withG) {
+        uint32_t sum = runs[0] + runs[1] + runs[2] + runs[3];
+        // Rounded runs[i] * 7 / sum, dividing by multiplying with a rounded up
+        // reciprocal. That is exact while numerator times divisor stays under
+        // 2^32, which holds for sums under 2^13 (digits up to 8191 pixels wide).
+        uint64_t reciprocal = (sum < (1u << 13)) ? ((uint64_t(1) << 32) + 2 * sum - 1) / (2 * sum) : 0;
+        int key = 0;
+        for (int i = 0; i < 4; i++) {
+            uint32_t numerator = 14 * runs[i] + sum;
+            uint32_t modules = reciprocal ? static_cast<uint32_t>((numerator * reciprocal) >> 32) : numerator / (2 * sum);
+            if (modules == 0) modules = 1;
+            if (modules > 4) modules = 4;
+            key = (key << 2) | (modules - 1);
+        }
+        uint8_t index = DigitWidthTable[key];
+        if (index < (withG ? 20 : 10)) return index;
+
+        // Rounding failed when sampling pushed a run over a module boundary, take the
+        // digit with the least total deviation instead, if that is under 1.5 modules.
+        uint32_t bestError = 3 * sum;  // 1.5 modules, errors are scaled by 2 * sum / 7
+        index = DecodeInvalid;
+        for (int candidate = 0; candidate < (withG ? 20 : 10); candidate++) {
+            uint32_t error = 0;
+            for (int i = 0; i < 4; i++) {
+                uint32_t measured = 14 * runs[i];
+                uint32_t expected = 2 * sum * DigitWidths[candidate][i];
+                error += (measured > expected) ? measured - expected : expected - measured;
+            }
+            if (error < bestError) {
+                bestError = error;
+                index = candidate;
+            }
+        }
+        return index;
+    }
+
+    // Returns whether a symbol's guards have about the widths they must have
+    // relative to the whole symbol, 3, 5 and 3 of its 95 (EAN-13) or 67 (EAN-8)
+    // modules. edges are the positions where its runs start, from the start guard
+    // on. This rejects most candidate start guards before any digit is decoded.
+    bool guardsFit(const uint32_t *edges, int digitsPerHalf) {
+        uint32_t modules = (digitsPerHalf == 6) ? 95 : 67;
+        int middle = 3 + 4 * digitsPerHalf;
+        int end = middle + 5 + 4 * digitsPerHalf;
+        uint32_t total = edges[end + 3] - edges[0];
+        uint32_t widths[3] = {edges[3] - edges[0], edges[middle + 5] - edges[middle], edges[end + 3] - edges[end]};
+        uint32_t expected[3] = {3, 5, 3};
+        for (int i = 0; i < 3; i++) {
+            // Within half and one and a half times the expected width.
+            uint32_t measured = 2 * widths[i] * modules;
+            if (measured < expected[i] * total || measured > 3 * expected[i] * total) return false;
+        }
+        return true;
+    }
+
+    // Decodes an EAN-13 (digitsPerHalf 6) or EAN-8 (4) symbol whose start guard
+    // begins at the bar runs[0]. There must be enough runs for the whole symbol.
+    bool decodeSymbol(const uint32_t *runs, int digitsPerHalf, Barcode &barcode) {
+        int code[13];
+        int size = 0;
+        int parity = 0;
+        if (!isGuard(runs, 3)) return false;
+        runs += 3;
+        for (int n = 0; n < digitsPerHalf; n++, runs += 4) {
+            uint8_t index = decodeDigit(runs, digitsPerHalf == 6);
+            if (index == DecodeInvalid) return false;
+            parity = (parity << 1) | (index >= 10 ? 1 : 0);
+            code[++size] = index % 10;
+        }
+        if (!isGuard(runs, 5)) return false;
+        runs += 5;
+        for (int n = 0; n < digitsPerHalf; n++, runs += 4) {
+            uint8_t index = decodeDigit(runs, false);
+            if (index == DecodeInvalid) return false;
+            code[++size] = index;
+        }
+        if (!isGuard(runs, 3)) return false;
+
+        // code[0] is left for the first EAN-13 digit, the one whose parity pattern
+        // matches the left half.
+        int first = 0;
+        if (digitsPerHalf == 6) {
+            while (first < 10 && EanParityPattern[first] != parity) first++;
+            if (first == 10) return false;
+            code[0] = first;
+        }
+        // UPC-A is EAN-13 with international code 0, EAN-8 has no first digit.
+        const int *begin = (first == 0) ? code + 1 : code;
+        const int *end = code + size + 1;
+        if (checkDigit(begin, end - begin - 1) != end[-1]) return false;
+
+        barcode.codeType = (digitsPerHalf == 4) ? EAN_8 : (first == 0) ? UPC_A : EAN_13;
+        barcode.code.assign(begin, end);
+        return true;
+    }
+    }
+
+Raster rasterize(const std::vector<int> &code, Encoding codeType, FileType fileType) {
+    BARGENLIB_RECORD();
+    ImageInfo info = imageInfo(fileType);
+    Raster raster;
+    // Fired here rather than in the encoders, as UPC-A is drawn by the EAN-13 one.
+    BARGENLIB_PROBE2(encode__entry, codeType, code.size());
+    switch (codeType) {
+        case EAN_8:
+            encodeEAN8(info, raster.pixels, code);
+            break;
+        case EAN_13:
+            encodeEAN13(info, raster.pixels, code);
+            break;
+        case UPC_A:
+        default:
+            encodeUPCA(info, raster.pixels, code);
+            break;
+    }
+    BARGENLIB_PROBE3(encode__return, codeType, code.size(), raster.pixels.size());
+    raster.fileType = fileType;
+    raster.width = info.width;
+    raster.height = info.height;
+    BARGENLIB_RECORD_SUCCEEDED();
+    return raster;
+}
+
+std::vector<unsigned char> encode(const Raster &raster) {
+    BARGENLIB_RECORD();
+    if (raster.fileType < BMP || raster.fileType > PNG_A) {
+        throw std::invalid_argument("A raster must be for BMP, PNG or PNG_A.");
+    }
+    if (raster.width <= 0 || raster.height <= 0) {
+        throw std::invalid_argument("A raster must be at least 1 pixel wide and high.");
+    }
+    // Rows are written as they are, so BMP can't take widths that need row padding.
+    if (raster.fileType == BMP && raster.width % 4 != 0) {
+        throw std::invalid_argument("A BMP raster's width must be a multiple of 4.");
+    }
+    std::uint64_t pixelBytes = (raster.fileType == PNG_A) ? 2 : 1;
+    if (raster.pixels.size() != pixelBytes * static_cast<std::uint64_t>(raster.width) * raster.height) {
+        throw std::invalid_argument("A raster's pixels must match its width and height.");
+    }
+    BARGENLIB_COUNT(bytesIn, raster.pixels.size());
+    ImageInfo info = imageInfo(raster.fileType);
+    info.width = raster.width;
+    info.height = raster.height;
+    std::vector<uint8_t> file;
+    switch (raster.fileType) {
+        case FileType::PNG:
+        case FileType::PNG_A:
+            encodePNG(info, raster.pixels, file);
+            break;
+        case FileType::BMP:
+        default:
+            encodeBMP(info, raster.pixels, file);
+            break;
+    }
+    BARGENLIB_COUNT(bytesOut, file.size());
+    BARGENLIB_RECORD_SUCCEEDED();
+    return file;
+}
+
+std::vector<unsigned char> render(const std::vector<int> &code, Encoding codeType, FileType fileType) {
+    bool memory = CacheEnabled.load(std::memory_order_relaxed);
+    bool disk = DiskCacheOpen.load(std::memory_order_acquire);
+    if ((!memory && !disk) || !hasKey(code)) return encode(rasterize(code, codeType, fileType));
+    std::string key = cacheKey(code, codeType, fileType);
+    if (memory) {
+        std::shared_ptr<const std::vector<uint8_t>> cached = cacheFind(key);
+        if (cached) {
+            CacheHits.fetch_add(1, std::memory_order_relaxed);
+            return *cached;
+        }
+        CacheMisses.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::vector<uint8_t> file;
+    if (disk && diskCacheFind(key, file)) {
+        DiskHits.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        if (disk) DiskMisses.fetch_add(1, std::memory_order_relaxed);
+        file = encode(rasterize(code, codeType, fileType));
+        if (disk) diskCacheInsert(key, file);
+    }
+    if (memory) cacheInsert(key, std::make_shared<const std::vector<uint8_t>>(file));
+    return file;
+}
+
+bool renderRegion(const std::vector<int> &code, Encoding codeType, FileType fileType, FileRegion &region) {
+    if (!hasKey(code)) rasterize(code, codeType, fileType);
+    if (!DiskCacheOpen.load(std::memory_order_acquire) || !hasKey(code)) return false;
+    std::string key = cacheKey(code, codeType, fileType);
+    if (diskCacheRegion(key, region)) {
+        DiskHits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    DiskMisses.fetch_add(1, std::memory_order_relaxed);
+    diskCacheInsert(key, encode(rasterize(code, codeType, fileType)));
+    return diskCacheRegion(key, region);
+}
+
+bool sendRegion(int out, FileRegion &region) {
+#ifdef BARGENLIB_POSIX
+    while (region.size > 0) {
+#ifdef BARGENLIB_SENDFILE
+        off_t offset = static_cast<off_t>(region.offset);
+        ssize_t sent = sendfile(out, region.fd, &offset, static_cast<std::size_t>(region.size));
+#else
+        uint8_t buffer[65536];
+        std::size_t chunk = static_cast<std::size_t>(std::min<std::uint64_t>(region.size, sizeof(buffer)));
+        ssize_t sent = pread(region.fd, buffer, chunk, static_cast<off_t>(region.offset));
+        if (sent > 0) sent = write(out, buffer, sent);
+#endif
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (sent <= 0) return false;
+        region.offset += sent;
+        region.size -= sent;
+    }
+    return true;
+#else
+    (void)out;
+    (void)region;
+    return false;
+#endif
+}
+
+void setCacheCapacity(std::size_t bytes) {
+    for (CacheShard &shard : Cache) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.capacity = bytes / CacheShards;
+        evict(shard);
+    }
+    CacheEnabled.store(bytes / CacheShards > 0, std::memory_order_relaxed);
+}
+
+CacheStats cacheStats() {
+    CacheStats stats = CacheStats();
+    stats.hits = CacheHits.load(std::memory_order_relaxed);
+    stats.misses = CacheMisses.load(std::memory_order_relaxed);
+    stats.evictions = CacheEvictions.load(std::memory_order_relaxed);
+    stats.diskHits = DiskHits.load(std::memory_order_relaxed);
+    stats.diskMisses = DiskMisses.load(std::memory_order_relaxed);
+    for (CacheShard &shard : Cache) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        stats.entries += shard.entries.size();
+        stats.bytes += shard.bytes;
+    }
+    return stats;
+}
+
+void clearCache() {
+    for (CacheShard &shard : Cache) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.entries.clear();
+        shard.index.clear();
+        shard.bytes = 0;
+    }
+}
+
+bool openDiskCache(const std::string &directory, std::size_t maxBytes, std::size_t slots) {
+#ifdef BARGENLIB_POSIX
+    closeDiskCache();
+    if (!Disk.open(directory, maxBytes, slots)) {
+        Disk.close();
+        return false;
+    }
+    DiskCacheOpen.store(true, std::memory_order_release);
+    return true;
+#else
+    (void)directory;
+    (void)maxBytes;
+    (void)slots;
+    return false;
+#endif
+}
+
+void closeDiskCache() {
+#ifdef BARGENLIB_POSIX
+    DiskCacheOpen.store(false, std::memory_order_relaxed);
+    Disk.close();
+#endif
+}
+
+struct ArchiveWriter::Impl {
+    std::ofstream out;
+    std::string path;
+    std::vector<ArchiveEntry> entries;
+    std::uint64_t offset;
+    bool finished;
+};
+
+ArchiveWriter::ArchiveWriter(const std::string &path) : impl(new Impl()) {
+    impl->out.open(path, std::ios_base::binary | std::ios_base::trunc);
+    impl->out.write(ArchiveMagic, sizeof(ArchiveMagic));
+    impl->path = path;
+    impl->offset = sizeof(ArchiveMagic);
+    impl->finished = false;
+    if (!impl->out) {
+        delete impl;
+        throw std::runtime_error("Could not create the archive " + path + ".");
+    }
+}
+
+ArchiveWriter::~ArchiveWriter() {
+    try {
+        finish();
+    } catch (const std::exception &) {
+    }
+    delete impl;
+}
+
+void ArchiveWriter::add(const std::vector<int> &code, Encoding codeType, FileType fileType) {
+    if (impl->finished) throw std::runtime_error("The archive " + impl->path + " is already finished.");
+    if (code.size() > 255) throw std::invalid_argument("A code in an archive must have at most 255 digits.");
+    std::vector<unsigned char> file = render(code, codeType, fileType);
+    impl->out.write(reinterpret_cast<const char*>(file.data()), file.size());
+    if (!impl->out) throw std::runtime_error("Could not write to the archive " + impl->path + ".");
+    ArchiveEntry entry = {codeType, fileType, code, impl->offset, file.size()};
+    impl->entries.push_back(entry);
+    impl->offset += file.size();
+    BARGENLIB_COUNT(bytesWritten, file.size());
+}
+
+void ArchiveWriter::finish() {
+    if (impl->finished) return;
+    impl->finished = true;
+    std::vector<uint8_t> index;
+    for (const ArchiveEntry &entry : impl->entries) {
+        index.push_back(static_cast<uint8_t>(entry.codeType));
+        index.push_back(static_cast<uint8_t>(entry.fileType));
+        index.push_back(static_cast<uint8_t>(entry.code.size()));
+        for (int digit : entry.code) index.push_back(static_cast<uint8_t>(digit));
+        putLE(index, entry.offset, 8);
+        putLE(index, entry.size, 4);
+    }
+    putLE(index, impl->offset, 8);
+    putLE(index, impl->entries.size(), 8);
+    index.insert(index.end(), ArchiveIndexMagic, ArchiveIndexMagic + sizeof(ArchiveIndexMagic));
+    impl->out.write(reinterpret_cast<const char*>(index.data()), index.size());
+    impl->out.close();
+    if (!impl->out) throw std::runtime_error("Could not write to the archive " + impl->path + ".");
+}
+
+struct BundleWriter::Impl {
+    std::ofstream file;
+    std::ostream *out;
+    BundleFormat format;
+    std::time_t time;
+    std::uint64_t offset;
+    std::vector<ZipEntry> entries;
+    bool finished;
+
+    void write(const std::vector<uint8_t> &bytes) {
+        out->write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        if (!*out) throw std::runtime_error("Could not write to the bundle.");
+        offset += bytes.size();
+    }
+};
+
+BundleWriter::BundleWriter(const std::string &path, BundleFormat format) : impl(new Impl()) {
+    impl->file.open(path, std::ios_base::binary | std::ios_base::trunc);
+    if (!impl->file) {
+        delete impl;
+        throw std::runtime_error("Could not create the bundle " + path + ".");
+    }
+    impl->out = &impl->file;
+    impl->format = format;
+    impl->time = std::time(nullptr);
+    impl->offset = 0;
+    impl->finished = false;
+}
+
+BundleWriter::BundleWriter(std::ostream &out, BundleFormat format) : impl(new Impl()) {
+    impl->out = &out;
+    impl->format = format;
+    impl->time = std::time(nullptr);
+    impl->offset = 0;
+    impl->finished = false;
+}
+
+BundleWriter::~BundleWriter() {
+    try {
+        finish();
+    } catch (const std::exception &) {
+    }
+    delete impl;
+}
+
+void BundleWriter::add(const std::string &name, const std::vector<int> &code, Encoding codeType,
+        FileType fileType) {
+    add(name, render(code, codeType, fileType));
+}
+
+void BundleWriter::add(const std::string &name, const std::vector<unsigned char> &file) {
+    if (impl->finished) throw std::runtime_error("The bundle is already finished.");
+    if (impl->format == TAR) {
+        impl->write(tarHeader(name, file.size(), impl->time));
+        impl->write(file);
+        impl->write(std::vector<uint8_t>((TarBlock - file.size() % TarBlock) % TarBlock, 0));
+    } else {
+        if (name.size() > 0xFFFF || file.size() >= Zip32Max) {
+            throw std::runtime_error("The name or image of " + name + " is too large for a zip bundle.");
+        }
+        ZipEntry entry = {name, lodepng_crc32(file.data(), file.size()), static_cast<uint32_t>(file.size()),
+                impl->offset};
+        std::vector<uint8_t> header;
+        putLE(header, 0x04034B50, 4);           // local file header
+        putLE(header, 20, 2);                   // version needed: 2.0
+        putLE(header, 0x0800, 2);               // names are UTF-8
+        putLE(header, 0, 2);                    // stored
+        putLE(header, dosTime(impl->time), 4);
+        putLE(header, entry.crc, 4);
+        putLE(header, entry.size, 4);           // compressed size
+        putLE(header, entry.size, 4);
+        putLE(header, name.size(), 2);
+        putLE(header, 0, 2);                    // extra field size
+        header.insert(header.end(), name.begin(), name.end());
+        impl->write(header);
+        impl->write(file);
+        impl->entries.push_back(entry);
+    }
+    BARGENLIB_COUNT(bytesWritten, file.size());
+}
+
+void BundleWriter::finish() {
+    if (impl->finished) return;
+    impl->finished = true;
+    if (impl->format == TAR) {
+        impl->write(std::vector<uint8_t>(2 * TarBlock, 0));
+    } else {
+        std::uint64_t directoryOffset = impl->offset;
+        for (const ZipEntry &entry : impl->entries) {
+            bool zip64 = entry.offset >= Zip32Max;
+            std::vector<uint8_t> header;
+            putLE(header, 0x02014B50, 4);       // central directory header
+            putLE(header, 3 << 8 | (zip64 ? 45 : 20), 2);  // made by: Unix
+            putLE(header, zip64 ? 45 : 20, 2);  // version needed
+            putLE(header, 0x0800, 2);
+            putLE(header, 0, 2);
+            putLE(header, dosTime(impl->time), 4);
+            putLE(header, entry.crc, 4);
+            putLE(header, entry.size, 4);
+            putLE(header, entry.size, 4);
+            putLE(header, entry.name.size(), 2);
+            putLE(header, zip64 ? 12 : 0, 2);   // extra field size
+            putLE(header, 0, 2);                // comment size
+            putLE(header, 0, 2);                // disk
+            putLE(header, 0, 2);                // internal attributes
+            putLE(header, 0100644u << 16, 4);   // external attributes: a regular file's Unix mode
+            putLE(header, zip64 ? Zip32Max : entry.offset, 4);
+            header.insert(header.end(), entry.name.begin(), entry.name.end());
+            if (zip64) {
+                putLE(header, 0x0001, 2);       // zip64 extended information
+                putLE(header, 8, 2);
+                putLE(header, entry.offset, 8);
+            }
+            impl->write(header);
+        }
+        std::uint64_t directorySize = impl->offset - directoryOffset;
+        std::uint64_t count = impl->entries.size();
+        std::vector<uint8_t> end;
+        if (count >= 0xFFFF || directoryOffset >= Zip32Max || directorySize >= Zip32Max) {
+            std::uint64_t recordOffset = impl->offset;
+            putLE(end, 0x06064B50, 4);          // zip64 end of central directory
+            putLE(end, 44, 8);
+            putLE(end, 45, 2);
+            putLE(end, 45, 2);
+            putLE(end, 0, 4);
+            putLE(end, 0, 4);
+            putLE(end, count, 8);
+            putLE(end, count, 8);
+            putLE(end, directorySize, 8);
+            putLE(end, directoryOffset, 8);
+            putLE(end, 0x07064B50, 4);          // zip64 end of central directory locator
+            putLE(end, 0, 4);
+            putLE(end, recordOffset, 8);
+            putLE(end, 1, 4);
+        }
+        putLE(end, 0x06054B50, 4);              // end of central directory
+        putLE(end, 0, 2);
+        putLE(end, 0, 2);
+        putLE(end, std::min<std::uint64_t>(count, 0xFFFF), 2);
+        putLE(end, std::min<std::uint64_t>(count, 0xFFFF), 2);
+        putLE(end, std::min(directorySize, Zip32Max), 4);
+        putLE(end, std::min(directoryOffset, Zip32Max), 4);
+        putLE(end, 0, 2);
+        impl->write(end);
+    }
+    impl->out->flush();
+    if (impl->file.is_open()) impl->file.close();
+    if (!*impl->out) throw std::runtime_error("Could not write to the bundle.");
+}
+
+struct AsyncWriter::Impl {
+#ifdef BARGENLIB_IO_URING
+    std::unique_ptr<WriteRing> ring;
+#endif
+    std::unique_ptr<WritePool> pool;
+    std::size_t queueDepth;
+    int threads;
+};
+
+AsyncWriter::AsyncWriter(std::size_t queueDepth, int threads) : impl(new Impl()) {
+    queueDepth = std::max<std::size_t>(queueDepth, 1);
+    impl->queueDepth = queueDepth;
+    impl->threads = threads;
+#ifdef BARGENLIB_IO_URING
+    impl->ring.reset(new WriteRing());
+    if (!impl->ring->open(queueDepth)) impl->ring.reset();
+    if (impl->ring) return;
+#endif
+    impl->pool.reset(new WritePool(queueDepth, threads));
+}
+
+AsyncWriter::~AsyncWriter() {
+    wait();
+    delete impl;
+}
+
+void AsyncWriter::submit(const std::string &path, std::vector<unsigned char> file) {
+    WriteJob job;
+    job.path = path;
+    job.file.swap(file);
+#ifdef BARGENLIB_IO_URING
+    if (impl->ring) {
+        if (impl->ring->submit(job)) return;
+        // The ring failed; the rest of the batch goes to threads.
+        if (!impl->pool) impl->pool.reset(new WritePool(impl->queueDepth, impl->threads));
+    }
+#endif
+    impl->pool->submit(std::move(job));
+}
+
+void AsyncWriter::submit(const std::string &path, const std::vector<int> &code, Encoding codeType,
+        FileType fileType) {
+    submit(path, render(code, codeType, fileType));
+}
+
+std::vector<WriteError> AsyncWriter::wait() {
+    std::vector<WriteError> errors;
+#ifdef BARGENLIB_IO_URING
+    if (impl->ring) errors = impl->ring->wait();
+#endif
+    if (impl->pool) {
+        std::vector<WriteError> more = impl->pool->wait();
+        errors.insert(errors.end(), more.begin(), more.end());
+    }
+    return errors;
+}
+
+bool AsyncWriter::usesIoUring() const {
+#ifdef BARGENLIB_IO_URING
+    return impl->ring && !impl->ring->failed();
+#else
+    return false;
+#endif
+}
+
+struct DurableWriter::Impl {
+    AsyncWriter writer;
+    std::size_t groupSize;
+    std::vector<std::string> paths;  // of the current group
+    std::unordered_set<std::string> pending;  // the same paths, for lookups
+    std::vector<WriteError> errors;
+
+    Impl(std::size_t groupSize) : groupSize(std::max<std::size_t>(groupSize, 1)) {}
+
+    static std::string directory(const std::string &path) {
+        std::size_t slash = path.rfind('/');
+        if (slash == std::string::npos) return ".";
+        return slash == 0 ? "/" : path.substr(0, slash);
+    }
+
+    static std::string temporaryPath(const std::string &path) {
+        std::size_t slash = path.rfind('/');
+        std::size_t name = (slash == std::string::npos) ? 0 : slash + 1;
+        return path.substr(0, name) + "." + path.substr(name) + ".tmp";
+    }
+
+    // Makes the group's temporary files durable, then renames them.
+    void commitGroup() {
+        std::unordered_map<std::string, int> failed;
+        for (WriteError &error : writer.wait()) failed[error.path] = error.error;
+        std::vector<std::string> written;
+        for (const std::string &path : paths) {
+            std::string temporary = temporaryPath(path);
+            auto error = failed.find(temporary);
+            if (error == failed.end()) {
+                written.push_back(path);
+            } else {
+                errors.push_back(WriteError{path, error->second});
+                std::remove(temporary.c_str());
+            }
+        }
+        paths.clear();
+        pending.clear();
+
+        std::unordered_set<std::string> directories;
+        for (const std::string &path : written) directories.insert(directory(path));
+        int syncError = 0;
+#if defined(BARGENLIB_POSIX) && defined(__linux__)
+        // One syncfs() per file system flushes every file of the group.
+        std::vector<dev_t> synced;
+        for (const std::string &path : directories) {
+            struct stat info;
+            int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0 || fstat(fd, &info) != 0) syncError = errno;
+            else if (std::find(synced.begin(), synced.end(), info.st_dev) == synced.end()) {
+                if (syncfs(fd) != 0) syncError = errno;
+                synced.push_back(info.st_dev);
+            }
+            if (fd >= 0) ::close(fd);
+        }
+#elif defined(BARGENLIB_POSIX)
+        for (const std::string &path : written) {
+            int fd = ::open(temporaryPath(path).c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0 || fsync(fd) != 0) syncError = errno;
+            if (fd >= 0) ::close(fd);
+        }
+#endif
+        std::vector<std::string> renamed;
+        for (const std::string &path : written) {
+            std::string temporary = temporaryPath(path);
+            if (syncError) {
+                errors.push_back(WriteError{path, syncError});
+                std::remove(temporary.c_str());
+            } else if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+                errors.push_back(WriteError{path, errno});
+                std::remove(temporary.c_str());
+            } else {
+                renamed.push_back(path);
+            }
+        }
+#ifdef BARGENLIB_POSIX
+        // The renames are durable once their directories are; if a directory
+        // can't be synced, every file renamed into it is reported.
+        std::unordered_map<std::string, int> unsynced;
+        for (const std::string &path : directories) {
+            int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0 || fsync(fd) != 0) unsynced[path] = errno;
+            if (fd >= 0) ::close(fd);
+        }
+        if (unsynced.empty()) return;
+        for (const std::string &path : renamed) {
+            auto error = unsynced.find(directory(path));
+            if (error != unsynced.end()) errors.push_back(WriteError{path, error->second});
+        }
+#endif
+    }
+};
+
+DurableWriter::DurableWriter(std::size_t groupSize) : impl(new Impl(groupSize)) {}
+
+DurableWriter::~DurableWriter() {
+    commit();
+    delete impl;
+}
+
+void DurableWriter::submit(const std::string &path, std::vector<unsigned char> file) {
+    // Both copies would be written to the same temporary file at once, so
+    // the earlier one is committed first.
+    if (!impl->pending.insert(path).second) {
+        impl->commitGroup();
+        impl->pending.insert(path);
+    }
+    impl->writer.submit(Impl::temporaryPath(path), std::move(file));
+    impl->paths.push_back(path);
+    if (impl->paths.size() >= impl->groupSize) impl->commitGroup();
+}
+
+void DurableWriter::submit(const std::string &path, const std::vector<int> &code, Encoding codeType,
+        FileType fileType) {
+    submit(path, render(code, codeType, fileType));
+}
+
+std::vector<WriteError> DurableWriter::commit() {
+    impl->commitGroup();
+    std::vector<WriteError> result;
+    result.swap(impl->errors);
+    return result;
+}
+
+ShardedLayout::ShardedLayout(const std::string &root, ShardScheme scheme, int fanOut, int levels)
+        : root(root), scheme(scheme), fanOut(fanOut), levels(levels), width(1) {
+    if (fanOut < 2 || levels < 0 || levels > 4) {
+        throw std::invalid_argument("A sharded layout needs a fan-out of 2 or more and 0-4 levels.");
+    }
+    if (scheme == SHARD_PREFIX && fanOut != 10 && fanOut != 100 && fanOut != 1000) {
+        throw std::invalid_argument("A prefix sharded layout needs a fan-out of 10, 100 or 1000.");
+    }
+    long long directories = 0, perLevel = 1;
+    for (int level = 0; level < levels && directories <= (1 << 20); level++) {
+        perLevel *= fanOut;
+        directories += perLevel;
+    }
+    if (directories > (1 << 20)) {
+        throw std::invalid_argument("A sharded layout must have at most 2^20 directories.");
+    }
+    width = static_cast<int>(std::to_string(fanOut - 1).size());
+    makeShards(root, fanOut, levels, width);
+}
+
+std::string ShardedLayout::directory(const std::vector<int> &code) const {
+    for (int digit : code) {
+        if (digit < 0 || digit > 9) throw std::invalid_argument("A code's digits must be 0-9.");
+    }
+    std::string result = root;
+    // FNV-1a over the digits; each level takes the next "digit" in base fanOut.
+    std::uint64_t hash = 14695981039346656037ull;
+    for (int digit : code) hash = (hash ^ static_cast<std::uint64_t>(digit)) * 1099511628211ull;
+    std::size_t position = 0;
+    for (int level = 0; level < levels; level++) {
+        int shard = 0;
+        if (scheme == SHARD_HASH) {
+            shard = static_cast<int>(hash % fanOut);
+            hash /= fanOut;
+        } else {
+            // Codes shorter than the prefix continue with zeros.
+            for (int i = 0; i < width; i++, position++) {
+                shard = shard * 10 + (position < code.size() ? code[position] : 0);
+            }
+        }
+        std::string name = std::to_string(shard);
+        result += "/" + std::string(width - name.size(), '0') + name;
+    }
+    return result;
+}
+
+std::string ShardedLayout::path(const std::vector<int> &code, FileType fileType) const {
+    std::string result = directory(code) + "/";
+    for (int digit : code) result += static_cast<char>('0' + digit);
+    return result + (fileType == BMP ? ".bmp" : ".png");
+}
+
+struct ArchiveReader::Impl {
+    int fd;
+    const uint8_t *data;
+    std::size_t size;
+    bool mapped;
+    std::vector<uint8_t> buffer;  // the archive, where it is not mapped
+    std::vector<ArchiveEntry> entries;
+    std::unordered_map<std::string, std::size_t> index;
+
+    void close() {
+#ifdef BARGENLIB_POSIX
+        if (mapped) munmap(const_cast<uint8_t*>(data), size);
+        if (fd >= 0) ::close(fd);
+#endif
+    }
+};
+
+ArchiveReader::ArchiveReader(const std::string &path) : impl(new Impl()) {
+    impl->fd = -1;
+    impl->data = nullptr;
+    impl->size = 0;
+    impl->mapped = false;
+    bool loaded = false;
+#ifdef BARGENLIB_POSIX
+    impl->fd = ::open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (impl->fd >= 0 && fstat(impl->fd, &info) == 0 && info.st_size > 0) {
+        impl->size = info.st_size;
+        void *mapping = mmap(nullptr, impl->size, PROT_READ, MAP_SHARED, impl->fd, 0);
+        if (mapping != MAP_FAILED) {
+            impl->data = static_cast<const uint8_t*>(mapping);
+            impl->mapped = true;
+            loaded = true;
+        }
+    }
+#else
+    std::ifstream in(path, std::ios_base::binary);
+    impl->buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    impl->data = impl->buffer.data();
+    impl->size = impl->buffer.size();
+    loaded = static_cast<bool>(in) || in.eof();
+#endif
+
+    // Parses the trailer and the index, checking every offset against the file.
+    const uint8_t *data = impl->data;
+    std::size_t size = impl->size;
+    bool valid = loaded && size >= sizeof(ArchiveMagic) + ArchiveTrailerSize
+            && std::memcmp(data, ArchiveMagic, sizeof(ArchiveMagic)) == 0
+            && std::memcmp(data + size - sizeof(ArchiveIndexMagic), ArchiveIndexMagic, sizeof(ArchiveIndexMagic)) == 0;
+    std::uint64_t indexEnd = size - ArchiveTrailerSize;
+    std::uint64_t position = valid ? getLE(data + indexEnd, 8) : 0;
+    std::uint64_t count = valid ? getLE(data + indexEnd + 8, 8) : 0;
+    valid = valid && position >= sizeof(ArchiveMagic) && position <= indexEnd && count <= indexEnd - position;
+    for (std::uint64_t i = 0; valid && i < count; i++) {
+        if (indexEnd - position < 3 || data[position] > EAN_8 || data[position + 1] > PNG_A) {
+            valid = false;
+            break;
+        }
+        ArchiveEntry entry;
+        entry.codeType = static_cast<Encoding>(data[position]);
+        entry.fileType = static_cast<FileType>(data[position + 1]);
+        std::size_t digits = data[position + 2];
+        position += 3;
+        if (indexEnd - position < digits + 12) {
+            valid = false;
+            break;
+        }
+        entry.code.assign(data + position, data + position + digits);
+        for (int digit : entry.code) valid = valid && digit <= 9;
+        position += digits;
+        entry.offset = getLE(data + position, 8);
+        entry.size = getLE(data + position + 8, 4);
+        position += 12;
+        valid = valid && entry.offset <= indexEnd && entry.size <= indexEnd - entry.offset;
+        impl->index[cacheKey(entry.code, entry.codeType, entry.fileType)] = impl->entries.size();
+        impl->entries.push_back(entry);
+    }
+    if (!valid) {
+        impl->close();
+        delete impl;
+        throw std::runtime_error("Could not read the archive " + path + ".");
+    }
+}
+
+ArchiveReader::~ArchiveReader() {
+    impl->close();
+    delete impl;
+}
+
+std::size_t ArchiveReader::size() const {
+    return impl->entries.size();
+}
+
+const ArchiveEntry &ArchiveReader::entry(std::size_t index) const {
+    return impl->entries.at(index);
+}
+
+const unsigned char *ArchiveReader::data(const ArchiveEntry &entry) const {
+    return impl->data + entry.offset;
+}
+
+const ArchiveEntry *ArchiveReader::find(const std::vector<int> &code, Encoding codeType, FileType fileType) const {
+    if (!hasKey(code)) return nullptr;
+    auto found = impl->index.find(cacheKey(code, codeType, fileType));
+    return (found == impl->index.end()) ? nullptr : &impl->entries[found->second];
+}
+
+int ArchiveReader::fd() const {
+    return impl->fd;
+}
+
+FileRegion ArchiveReader::region(const ArchiveEntry &entry) const {
+    FileRegion region = {impl->fd, entry.offset, entry.size};
+    return region;
+}
+
+struct RingWriter::Impl {
+#ifdef BARGENLIB_RING
+    int fd;
+    RingMapping ring;
+    std::uint64_t writePos;
+#endif
+};
+
+RingWriter::RingWriter(std::size_t slots, std::size_t slotSize) : impl(new Impl()) {
+#ifdef BARGENLIB_RING
+    if (slots == 0 || slots > (1u << 20) || slotSize == 0 || slotSize > (1u << 30)) {
+        delete impl;
+        throw std::invalid_argument("A ring needs 1 to 2^20 slots of 1 byte to 1 GiB.");
+    }
+    std::uint64_t count = 1;
+    while (count < slots) count <<= 1;
+    // The magic, slots and slotSize; ftruncate() zeroes the rest of the header.
+    std::uint64_t header[3] = {0, count, slotSize};
+    std::memcpy(header, RingMagic, sizeof(RingMagic));
+    std::size_t bytes = sizeof(RingHeader) + count * RingMapping::strideFor(slotSize);
+
+    // Sealed at its size, so readers can't shrink the file under the writer's mapping.
+    impl->fd = memfd_create("bargenlib-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    bool created = impl->fd >= 0 && ftruncate(impl->fd, bytes) == 0
+            && pwrite(impl->fd, &header, sizeof(header), 0) == sizeof(header)
+            && fcntl(impl->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0
+            && impl->ring.map(impl->fd);
+    if (!created) {
+        int error = errno;
+        if (impl->fd >= 0) ::close(impl->fd);
+        delete impl;
+        throw std::runtime_error(std::string("Could not create the ring: ") + std::strerror(error) + ".");
+    }
+    for (std::uint64_t i = 0; i < count; i++) {
+        impl->ring.slot(i).sequence.store(i, std::memory_order_relaxed);
+    }
+    impl->writePos = 0;
+#else
+    (void)slots;
+    (void)slotSize;
+    delete impl;
+    throw std::runtime_error("Shared-memory rings are only supported on Linux.");
+#endif
+}
+
+RingWriter::~RingWriter() {
+#ifdef BARGENLIB_RING
+    RingHeader &header = *impl->ring.header;
+    header.closed.store(1);
+    header.published.fetch_add(1);
+    futexWake(header.published, INT_MAX);
+    impl->ring.unmap();
+    ::close(impl->fd);
+#endif
+    delete impl;
+}
+
+bool RingWriter::push(const std::vector<int> &code, Encoding codeType, FileType fileType, int timeoutMs) {
+#ifdef BARGENLIB_RING
+    if (code.size() > sizeof(RingSlot().code)) {
+        throw std::invalid_argument("A code in a ring must have at most 48 digits.");
+    }
+    std::vector<uint8_t> file = render(code, codeType, fileType);
+    if (file.size() > impl->ring.slotSize) {
+        throw std::runtime_error("The image is larger than the ring's slots.");
+    }
+
+    RingHeader &header = *impl->ring.header;
+    std::uint64_t position = impl->writePos;
+    RingSlot &slot = impl->ring.slot(position);
+    std::uint64_t deadline = (timeoutMs < 0) ? 0 : monotonicMs() + timeoutMs;
+    while (slot.sequence.load(std::memory_order_acquire) != position) {
+        // Full: wait for a reader to free the slot.
+        header.writerWaiting.store(1);
+        uint32_t seen = header.consumed.load();
+        bool waited = slot.sequence.load(std::memory_order_acquire) == position
+                || futexWait(header.consumed, seen, deadline);
+        header.writerWaiting.store(0);
+        if (!waited) return false;
+    }
+
+    slot.size = static_cast<uint32_t>(file.size());
+    slot.codeType = static_cast<uint8_t>(codeType);
+    slot.fileType = static_cast<uint8_t>(fileType);
+    slot.digits = static_cast<uint8_t>(code.size());
+    for (std::size_t i = 0; i < code.size(); i++) slot.code[i] = static_cast<uint8_t>(code[i]);
+    std::memcpy(reinterpret_cast<uint8_t*>(&slot + 1), file.data(), file.size());
+    slot.sequence.store(position + 1, std::memory_order_release);
+    impl->writePos = position + 1;
+
+    header.published.fetch_add(1);
+    if (header.readersWaiting.load() > 0) futexWake(header.published, 1);
+    return true;
+#else
+    (void)code;
+    (void)codeType;
+    (void)fileType;
+    (void)timeoutMs;
+    return false;
+#endif
+}
+
+int RingWriter::fd() const {
+#ifdef BARGENLIB_RING
+    return impl->fd;
+#else
+    return -1;
+#endif
+}
+
+std::string RingWriter::path() const {
+#ifdef BARGENLIB_RING
+    return "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(impl->fd);
+#else
+    return std::string();
+#endif
+}
+
+struct RingReader::Impl {
+#ifdef BARGENLIB_RING
+    RingMapping ring;
+
+    // Claims the next image and copies it out, if there is one.
+    bool take(RingImage &image) {
+        RingHeader &header = *ring.header;
+        std::uint64_t position = header.readPos.load(std::memory_order_relaxed);
+        for (;;) {
+            RingSlot &slot = ring.slot(position);
+            std::int64_t ahead = static_cast<std::int64_t>(slot.sequence.load(std::memory_order_acquire)
+                    - (position + 1));
+            if (ahead < 0) return false;
+            if (ahead > 0) {
+                // Another reader took it already.
+                position = header.readPos.load(std::memory_order_relaxed);
+            } else if (header.readPos.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                bool valid = slot.size <= ring.slotSize && slot.digits <= sizeof(slot.code)
+                        && slot.codeType <= EAN_8 && slot.fileType <= PNG_A;
+                if (valid) {
+                    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(&slot + 1);
+                    image.codeType = static_cast<Encoding>(slot.codeType);
+                    image.fileType = static_cast<FileType>(slot.fileType);
+                    image.code.assign(slot.code, slot.code + slot.digits);
+                    image.file.assign(bytes, bytes + slot.size);
+                }
+                slot.sequence.store(position + ring.mask + 1, std::memory_order_release);
+                header.consumed.fetch_add(1);
+                if (header.writerWaiting.load()) futexWake(header.consumed, 1);
+                if (!valid) throw std::runtime_error("The ring holds a corrupt image.");
+                return true;
+            }
+        }
+    }
+
+    bool empty() const {
+        std::uint64_t position = ring.header->readPos.load(std::memory_order_relaxed);
+        return ring.slot(position).sequence.load(std::memory_order_acquire) != position + 1;
+    }
+#endif
+};
+
+RingReader::RingReader(int fd) : impl(new Impl()) {
+#ifdef BARGENLIB_RING
+    if (impl->ring.map(fd)) return;
+#else
+    (void)fd;
+#endif
+    delete impl;
+    throw std::runtime_error("Could not map the ring.");
+}
+
+RingReader::RingReader(const std::string &path) : impl(new Impl()) {
+#ifdef BARGENLIB_RING
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    bool mapped = fd >= 0 && impl->ring.map(fd);
+    if (fd >= 0) ::close(fd);
+    if (mapped) return;
+#endif
+    delete impl;
+    throw std::runtime_error("Could not map the ring " + path + ".");
+}
+
+RingReader::~RingReader() {
+#ifdef BARGENLIB_RING
+    impl->ring.unmap();
+#endif
+    delete impl;
+}
+
+bool RingReader::pop(RingImage &image, int timeoutMs) {
+#ifdef BARGENLIB_RING
+    RingHeader &header = *impl->ring.header;
+    std::uint64_t deadline = (timeoutMs < 0) ? 0 : monotonicMs() + timeoutMs;
+    for (;;) {
+        if (impl->take(image)) return true;
+        header.readersWaiting.fetch_add(1);
+        uint32_t seen = header.published.load();
+        bool waited = !impl->empty() || header.closed.load() || futexWait(header.published, seen, deadline);
+        header.readersWaiting.fetch_sub(1);
+        if (!waited) return false;
+        if (header.closed.load() && impl->empty()) return false;
+    }
+#else
+    (void)image;
+    (void)timeoutMs;
+    return false;
+#endif
+}
+
+bool RingReader::closed() const {
+#ifdef BARGENLIB_RING
+    return impl->ring.header->closed.load() && impl->empty();
+#else
+    return true;
+#endif
+}
+
+void save(const std::vector<int> &code, const std::string &path,
+        Encoding codeType, FileType fileType, bool verify) {
+    BARGENLIB_RECORD();
+    BARGENLIB_TIMER(codeType, fileType);
+    BARGENLIB_PROBE3(save__entry, code.size(), codeType, fileType);
+    std::vector<unsigned char> file = render(code, codeType, fileType);
+    BARGENLIB_LAP(LATENCY_ENCODE);
+    writeFile(file, path);
+    BARGENLIB_LAP(LATENCY_WRITE);
+    if (verify) verifyImage(imageInfo(fileType), code, path, codeType);
+    BARGENLIB_TIMER_DONE();
+    BARGENLIB_PROBE3(save__return, code.size(), fileType, file.size());
+    BARGENLIB_RECORD_SUCCEEDED();
+}
+
+bool statsEnabled() {
+#ifdef BARGENLIB_INSTRUMENT
+    return true;
+#else
+    return false;
+#endif
+}
+
+Stats stats() {
+#ifdef BARGENLIB_INSTRUMENT
+    std::lock_guard<std::mutex> lock(StatsMutex);
+    return TotalStats;
+#else
+    return Stats();
+#endif
+}
+
+void resetStats() {
+#ifdef BARGENLIB_INSTRUMENT
+    std::lock_guard<std::mutex> lock(StatsMutex);
+    TotalStats = Stats();
+    for (auto &latency : Histograms) {
+        for (auto &encoding : latency) {
+            for (Histogram &histogram : encoding) {
+                for (auto &bucket : histogram.buckets) bucket.store(0, std::memory_order_relaxed);
+                histogram.count.store(0, std::memory_order_relaxed);
+                histogram.sum.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+#endif
+}
+
+std::string metricsText() {
+    std::string text;
+#ifdef BARGENLIB_INSTRUMENT
+    Stats totals = stats();
+    text += "# HELP bargenlib_calls_total Calls of save(), rasterize() and encode().\n";
+    text += "# TYPE bargenlib_calls_total counter\n";
+    appendf(text, "bargenlib_calls_total %llu\n", static_cast<unsigned long long>(totals.calls));
+    text += "# HELP bargenlib_errors_total Calls that failed.\n";
+    text += "# TYPE bargenlib_errors_total counter\n";
+    appendf(text, "bargenlib_errors_total %llu\n", static_cast<unsigned long long>(totals.errors));
+    text += "# HELP bargenlib_written_bytes_total Bytes written to image files.\n";
+    text += "# TYPE bargenlib_written_bytes_total counter\n";
+    appendf(text, "bargenlib_written_bytes_total %llu\n", static_cast<unsigned long long>(totals.bytesWritten));
+    text += "# HELP bargenlib_stage_seconds_total Time spent in each stage.\n";
+    text += "# TYPE bargenlib_stage_seconds_total counter\n";
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        appendf(text, "bargenlib_stage_seconds_total{stage=\"%s\"} %.9g\n", StageNames[stage],
+                totals.stages[stage].nanoseconds / 1e9);
+    }
+
+    const char *help[LATENCY_COUNT] = {
+        "Latency of save() calls.",
+        "Latency of rasterizing and encoding in save().",
+        "Latency of writing the file in save().",
+    };
+    for (int latency = 0; latency < LATENCY_COUNT; latency++) {
+        std::string name = std::string("bargenlib_") + LatencyNames[latency] + "_duration_seconds";
+        appendf(text, "# HELP %s %s\n", name.c_str(), help[latency]);
+        appendf(text, "# TYPE %s summary\n", name.c_str());
+        for (int codeType = 0; codeType < 3; codeType++) {
+            for (int fileType = 0; fileType < 3; fileType++) {
+                char labels[64];
+                std::snprintf(labels, sizeof(labels), "encoding=\"%s\",file_type=\"%s\"",
+                        EncodingNames[codeType], FileTypeNames[fileType]);
+                appendSummary(text, name.c_str(), labels, Histograms[latency][codeType][fileType]);
+            }
+        }
+    }
+#endif
+    return text;
+}
+
+bool writeMetrics(const std::string &path) {
+#ifdef BARGENLIB_INSTRUMENT
+    // Written next to path and renamed over it, so scrapers never see half a file.
+    std::string text = metricsText();
+    std::string temporary = path + ".tmp";
+    std::ofstream out(temporary, std::ios::out | std::ios::binary);
+    out.write(text.data(), text.size());
+    out.close();
+    if (!out) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+void setStatsCallback(StatsCallback callback, void *context) {
+#ifdef BARGENLIB_INSTRUMENT
+    std::lock_guard<std::mutex> lock(StatsMutex);
+    Callback = callback;
+    CallbackContext = context;
+#else
+    (void)callback;
+    (void)context;
+#endif
+}
+
+bool startTrace(std::size_t eventsPerThread) {
+#ifdef BARGENLIB_INSTRUMENT
+    std::lock_guard<std::mutex> lock(TraceMutex);
+    if (Tracing || eventsPerThread == 0) return false;
+    TraceCapacity = eventsPerThread;
+    TraceEpoch = Clock::now();
+    TraceGeneration++;
+    Tracing = true;
+    return true;
+#else
+    (void)eventsPerThread;
+    return false;
+#endif
+}
+
+bool stopTrace(const std::string &path) {
+#ifdef BARGENLIB_INSTRUMENT
+    std::lock_guard<std::mutex> lock(TraceMutex);
+    if (!Tracing) return false;
+    Tracing = false;
+
+    std::ofstream out(path, std::ios::out | std::ios::binary);
+    out.setf(std::ios::fixed);
+    out.precision(3);
+    out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"bargenlib\"}}";
+    std::size_t tid = 0;
+    for (const std::unique_ptr<TraceBuffer> &traced : TraceBuffers) {
+        const TraceBuffer &buffer = *traced;
+        if (buffer.generation != TraceGeneration.load(std::memory_order_relaxed)) continue;
+        out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tid + 1
+            << ", \"args\": {\"name\": \"thread " << tid + 1 << "\"}}";
+        // Keeps the newest events once the ring wrapped. The oldest slot is
+        // skipped then, as a late span may still be overwriting it.
+        std::uint64_t head = buffer.head.load(std::memory_order_acquire);
+        std::uint64_t size = buffer.events.size();
+        std::uint64_t first = head > size ? head - size + 1 : 0;
+        for (std::uint64_t i = first; i < head; i++) {
+            const TraceEvent &event = buffer.events[i % size];
+            out << ",\n{\"name\": ";
+            writeJsonString(out, event.name);
+            out << ", \"cat\": \"bargenlib\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tid + 1
+                << ", \"ts\": " << event.start / 1000.0 << ", \"dur\": " << event.duration / 1000.0 << "}";
+        }
+        tid++;
+    }
+    out << "\n]}\n";
+    out.close();
+    return static_cast<bool>(out);
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+TraceSpan::TraceSpan(const char *name) : name(name), start(0) {
+#ifdef BARGENLIB_INSTRUMENT
+    if (Tracing.load(std::memory_order_relaxed)) {
+        start = Clock::now().time_since_epoch().count();
+    }
+#endif
+}
+
+TraceSpan::~TraceSpan() {
+#ifdef BARGENLIB_INSTRUMENT
+    if (start) traceSpan(name, Clock::time_point(Clock::duration(start)), Clock::now());
+#endif
+}
+
+bool decodeScanline(const unsigned char *pixels, std::size_t width, Barcode &barcode) {
+    if (width == 0) return false;
+
+    // Threshold halfway between the darkest and lightest pixel.
+    uint8_t darkest = 255, lightest = 0;
+    std::size_t x = 0;
+#ifdef BARGENLIB_SSE2
+    __m128i low = _mm_set1_epi8(static_cast<char>(255)), high = _mm_setzero_si128();
+    for (; x + 16 <= width; x += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + x));
+        low = _mm_min_epu8(low, block);
+        high = _mm_max_epu8(high, block);
+    }
+    uint8_t lows[16], highs[16];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lows), low);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(highs), high);
+    for (int i = 0; i < 16; i++) {
+        darkest = (lows[i] < darkest) ? lows[i] : darkest;
+        lightest = (highs[i] > lightest) ? highs[i] : lightest;
+    }
+#endif
+    for (; x < width; x++) {
+        darkest = (pixels[x] < darkest) ? pixels[x] : darkest;
+        lightest = (pixels[x] > lightest) ? pixels[x] : lightest;
+    }
+    if (lightest - darkest < 32) return false;  // No contrast, no bars
+    int threshold = (darkest + lightest + 1) / 2;
+
+    // Run-length extraction: first the positions where the colour changes, then
+    // the runs between them, alternating bars and spaces. The buffer holds both
+    // and is kept per thread so scanning many lines does not allocate.
+    static thread_local std::vector<uint32_t> buffer;
+    if (buffer.size() < 2 * (width + 1)) buffer.resize(2 * (width + 1));
+    uint32_t *edges = buffer.data();
+    bool firstIsBar = pixels[0] < threshold;
+    std::size_t count = 0;
+    edges[count++] = 0;
+#ifdef BARGENLIB_SSE2
+    // A bit per pixel, set for dark ones, 64 pixels at a time. The changes are
+    // the bits that differ from the one before, found with count trailing zeros.
+    __m128i below = _mm_set1_epi8(static_cast<char>(threshold - 1));
+    uint64_t previous = firstIsBar;
+    for (std::size_t base = 0; base < width; base += 64) {
+        std::size_t end = (width - base < 64) ? width : base + 64;
+        uint64_t dark = 0;
+        for (x = base; x + 16 <= end; x += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + x));
+            __m128i isDark = _mm_cmpeq_epi8(_mm_min_epu8(block, below), block);
+            dark |= static_cast<uint64_t>(static_cast<unsigned>(_mm_movemask_epi8(isDark))) << (x - base);
+        }
+        for (; x < end; x++) dark |= static_cast<uint64_t>(pixels[x] < threshold) << (x - base);
+        // Past the end of the line, repeat its last pixel so there is no change there.
+        if (end - base < 64 && ((dark >> (end - base - 1)) & 1)) dark |= ~uint64_t(0) << (end - base);
+        uint64_t changes = dark ^ ((dark << 1) | previous);
+        previous = dark >> 63;
+        while (changes) {
+            edges[count++] = static_cast<uint32_t>(base + __builtin_ctzll(changes));
+            changes &= changes - 1;
+        }
+    }
+#else
+    bool bar = firstIsBar;
+    for (x = 0; x < width; x++) {
+        bool dark = pixels[x] < threshold;
+        edges[count] = static_cast<uint32_t>(x);
+        count += dark != bar;
+        bar = dark;
+    }
+#endif
+    edges[count] = static_cast<uint32_t>(width);
+    uint32_t *runs = edges + count + 1;
+    for (std::size_t i = 0; i < count; i++) runs[i] = edges[i + 1] - edges[i];
+
+    // Try every bar after a quiet zone as the start guard, EAN-13 (59 runs) before
+    // EAN-8 (43 runs). The quiet zone must be at least as wide as the guard.
+    for (std::size_t i = firstIsBar ? 2 : 1; i + 43 <= count; i += 2) {
+        if (runs[i - 1] < runs[i] + runs[i + 1] + runs[i + 2]) continue;
+        if (i + 59 <= count && guardsFit(&edges[i], 6) && decodeSymbol(&runs[i], 6, barcode)) return true;
+        if (guardsFit(&edges[i], 4) && decodeSymbol(&runs[i], 4, barcode)) return true;
+    }
+    return false;
+}
+
+bool decodeImage(const unsigned char *pixels, std::size_t width, std::size_t height, Barcode &barcode) {
+    // The middle row first, then rows spreading out from it.
+    for (std::size_t i = 0; i < 9 && i < height; i++) {
+        std::size_t offset = ((i + 1) / 2) * height / 10;
+        std::size_t y = (i % 2) ? height / 2 - offset : height / 2 + offset;
+        if (y >= height) continue;
+        if (decodeScanline(pixels + y * width, width, barcode)) return true;
+    }
+    return false;
+}
+}
+
+#if defined(BARGENLIB_INSTRUMENT) && defined(LODEPNG_NO_COMPILE_ALLOCATORS)
+// lodepng's allocators (see LODEPNG_COMPILE_ALLOCATORS in lodepng.cpp), which
+// count the allocations of the calling thread's current call.
+void* lodepng_malloc(size_t size) {
+#ifdef LODEPNG_MAX_ALLOC
+    if (size > LODEPNG_MAX_ALLOC) return 0;
+#endif
+    bargenlib::CurrentStats.allocations++;
+    return std::malloc(size);
+}
+
+void* lodepng_realloc(void* ptr, size_t new_size) {
+#ifdef LODEPNG_MAX_ALLOC
+    if (new_size > LODEPNG_MAX_ALLOC) return 0;
+#endif
+    bargenlib::CurrentStats.allocations++;
+    return std::realloc(ptr, new_size);
+}
+
+void lodepng_free(void* ptr) {
+    std::free(ptr);
 }
-}
\ No newline at end of file
+#endif
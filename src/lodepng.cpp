@@ -35,10 +35,52 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <stdio.h> /* file handling */
 #endif /* LODEPNG_COMPILE_DISK */
 
+/*lodepng_map_file memory maps files on POSIX systems, elsewhere or when
+LODEPNG_NO_COMPILE_MMAP is defined it loads them into a buffer instead.*/
+#if defined(LODEPNG_COMPILE_DISK) && !defined(LODEPNG_NO_COMPILE_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define LODEPNG_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif /*LODEPNG_MMAP*/
+
 #ifdef LODEPNG_COMPILE_ALLOCATORS
 #include <stdlib.h> /* allocations */
 #endif /* LODEPNG_COMPILE_ALLOCATORS */
 
+/*x86 SIMD kernels are compiled with per-function target attributes and chosen at
+runtime with __builtin_cpu_supports, so the rest of the file keeps targeting the
+baseline instruction set. Define LODEPNG_NO_COMPILE_SIMD to disable them.*/
+#if !defined(LODEPNG_NO_COMPILE_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LODEPNG_SIMD_X86
+#include <immintrin.h>
+#define LODEPNG_TARGET(isa) __attribute__((target(isa)))
+#endif /*LODEPNG_SIMD_X86*/
+
+/*The multithreaded encoder paths use the C++11 thread library, so they are only
+available when this file is compiled as C++11 or later. Otherwise, or when
+LODEPNG_NO_COMPILE_THREADS is defined, all work runs on the calling thread.*/
+#if !defined(LODEPNG_NO_COMPILE_THREADS) && defined(LODEPNG_COMPILE_ENCODER) && defined(__cplusplus) &&\
+    (__cplusplus >= 201103L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201103L))
+#define LODEPNG_THREADS
+#include <atomic>
+#include <thread>
+#include <vector>
+#endif /*LODEPNG_THREADS*/
+
+/*USDT probes for bpftrace and perf on deflate and inflate, under the "lodepng"
+provider. They need sys/sdt.h from systemtap and are only compiled in when
+LODEPNG_USDT is defined; each one is a single nop until a tracer attaches.*/
+#if defined(LODEPNG_USDT) && defined(__linux__)
+#include <sys/sdt.h>
+#define LODEPNG_PROBE2(name, a, b) DTRACE_PROBE2(lodepng, name, a, b)
+#define LODEPNG_PROBE3(name, a, b, c) DTRACE_PROBE3(lodepng, name, a, b, c)
+#else
+#define LODEPNG_PROBE2(name, a, b) ((void)(a), (void)(b))
+#define LODEPNG_PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif /*LODEPNG_USDT*/
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
@@ -151,14 +193,16 @@ static int lodepng_addofl(size_t a, size_t b, size_t* result) {
 }
 #endif /*defined(LODEPNG_COMPILE_PNG) || defined(LODEPNG_COMPILE_DECODER)*/
 
-#ifdef LODEPNG_COMPILE_DECODER
+#if defined(LODEPNG_COMPILE_DECODER) || (defined(LODEPNG_COMPILE_ENCODER) && defined(LODEPNG_COMPILE_ZLIB))
 /* Safely check if multiplying two integers will overflow (no undefined
 behavior, compiler removing the code, etc...) and output result. */
 static int lodepng_mulofl(size_t a, size_t b, size_t* result) {
   *result = a * b; /* Unsigned multiplication is well defined and safe in C90 */
   return (a != 0 && *result / a != b);
 }
+#endif /*defined(LODEPNG_COMPILE_DECODER) || (defined(LODEPNG_COMPILE_ENCODER) && defined(LODEPNG_COMPILE_ZLIB))*/
 
+#ifdef LODEPNG_COMPILE_DECODER
 #ifdef LODEPNG_COMPILE_ZLIB
 /* Safely check if a + b > c, even if overflow could happen. */
 static int lodepng_gtofl(size_t a, size_t b, size_t c) {
@@ -203,6 +247,54 @@ Example: if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83);
   return;\
 }
 
+#ifdef LODEPNG_COMPILE_ENCODER
+/*Resolves the numthreads setting: 0 means one thread per hardware thread.*/
+static unsigned lodepng_get_numthreads(unsigned numthreads) {
+#ifdef LODEPNG_THREADS
+  if(numthreads == 0) numthreads = std::thread::hardware_concurrency();
+#endif /*LODEPNG_THREADS*/
+  return numthreads == 0 ? 1 : numthreads;
+}
+
+/*
+Calls task(context, i) once for each i in [0, count), spread over up to numthreads
+threads, the calling thread being one of them. Tasks are handed out in increasing
+order of i. Tasks must report their errors through the context. If threads are not
+compiled in or cannot be started, the remaining tasks run on the calling thread.
+*/
+static void lodepng_parallel_for(size_t count, unsigned numthreads,
+                                 void (*task)(void*, size_t), void* context) {
+  size_t i;
+  /* avoid warning about unused function in case of disabled COMPILE... macros */
+  (void)(&lodepng_parallel_for);
+#ifdef LODEPNG_THREADS
+  numthreads = lodepng_get_numthreads(numthreads);
+  if(numthreads > 1 && count > 1) {
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    auto worker = [&]() {
+      for(;;) {
+        size_t index = next++;
+        if(index >= count) break;
+        task(context, index);
+      }
+    };
+    try {
+      for(i = 1; i < numthreads && i < count; ++i) workers.emplace_back(worker);
+    } catch(...) {
+      /*could not start more threads, those already started and this one do the work*/
+    }
+    worker();
+    for(i = 0; i != workers.size(); ++i) workers[i].join();
+    return;
+  }
+#else /*LODEPNG_THREADS*/
+  (void)numthreads;
+#endif /*LODEPNG_THREADS*/
+  for(i = 0; i != count; ++i) task(context, i);
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 /*
 About uivector, ucvector and string:
 -All of them wrap dynamic arrays or text strings in a similar way.
@@ -340,49 +432,101 @@ static void lodepng_set32bitInt(unsigned char* buffer, unsigned value) {
 
 #ifdef LODEPNG_COMPILE_DISK
 
-/* returns negative value on error. This should be pure C compatible, so no fstat. */
-static long lodepng_filesize(const char* filename) {
-  FILE* file;
+/* returns negative value on error, and leaves the file positioned at its start.
+This should be pure C compatible, so no fstat. */
+static long lodepng_filesize(FILE* file) {
   long size;
-  file = fopen(filename, "rb");
-  if(!file) return -1;
-
-  if(fseek(file, 0, SEEK_END) != 0) {
-    fclose(file);
-    return -1;
-  }
+  if(fseek(file, 0, SEEK_END) != 0) return -1;
 
   size = ftell(file);
   /* It may give LONG_MAX as directory size, this is invalid for us. */
   if(size == LONG_MAX) size = -1;
 
-  fclose(file);
+  if(size >= 0 && fseek(file, 0, SEEK_SET) != 0) return -1;
   return size;
 }
 
-/* load file into buffer that already has the correct allocated size. Returns error code.*/
-static unsigned lodepng_buffer_file(unsigned char* out, size_t size, const char* filename) {
+unsigned lodepng_load_file(unsigned char** out, size_t* outsize, const char* filename) {
   FILE* file;
-  size_t readsize;
+  long size;
+  unsigned error = 0;
+  *out = 0;
+  *outsize = 0;
+
+  /*open the file once, for both its size and its contents*/
   file = fopen(filename, "rb");
   if(!file) return 78;
+  size = lodepng_filesize(file);
+  if(size < 0) error = 78;
 
-  readsize = fread(out, 1, size, file);
-  fclose(file);
+  if(!error) {
+    *out = (unsigned char*)lodepng_malloc((size_t)size);
+    if(!(*out) && size > 0) error = 83; /*the above malloc failed*/
+  }
+  if(!error) {
+    *outsize = (size_t)size;
+    if(fread(*out, 1, (size_t)size, file) != (size_t)size) error = 78;
+  }
 
-  if(readsize != size) return 78;
-  return 0;
+  fclose(file);
+  return error;
 }
 
-unsigned lodepng_load_file(unsigned char** out, size_t* outsize, const char* filename) {
-  long size = lodepng_filesize(filename);
-  if(size < 0) return 78;
-  *outsize = (size_t)size;
-
-  *out = (unsigned char*)lodepng_malloc((size_t)size);
-  if(!(*out) && size > 0) return 83; /*the above malloc failed*/
+unsigned lodepng_map_file(LodePNGFileView* view, const char* filename) {
+  view->data = 0;
+  view->size = 0;
+  view->mapped = 0;
+#ifdef LODEPNG_MMAP
+  {
+    struct stat st;
+    void* data;
+    int flags = MAP_PRIVATE;
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return 78;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      close(fd);
+      return 78;
+    }
+    if(st.st_size == 0) { /*empty mappings are not allowed, an empty view is valid*/
+      close(fd);
+      return 0;
+    }
+#ifdef MAP_POPULATE
+    /*the whole file is about to be read, fault it in now rather than page by page*/
+    flags |= MAP_POPULATE;
+#endif /*MAP_POPULATE*/
+    data = mmap(0, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+    close(fd); /*the mapping stays valid without the descriptor*/
+    if(data == MAP_FAILED) return 78;
+    view->data = (const unsigned char*)data;
+    view->size = (size_t)st.st_size;
+    view->mapped = 1;
+    return 0;
+  }
+#else /*LODEPNG_MMAP*/
+  {
+    unsigned char* buffer;
+    unsigned error = lodepng_load_file(&buffer, &view->size, filename);
+    if(error) {
+      lodepng_free(buffer);
+      view->size = 0;
+      return error;
+    }
+    view->data = buffer;
+    return 0;
+  }
+#endif /*LODEPNG_MMAP*/
+}
 
-  return lodepng_buffer_file(*out, (size_t)size, filename);
+void lodepng_unmap_file(LodePNGFileView* view) {
+#ifdef LODEPNG_MMAP
+  if(view->mapped) munmap((void*)view->data, view->size);
+  else
+#endif /*LODEPNG_MMAP*/
+  lodepng_free((void*)view->data);
+  view->data = 0;
+  view->size = 0;
+  view->mapped = 0;
 }
 
 /*write given buffer to the file, overwriting the file, it doesn't append to it.*/
@@ -661,6 +805,7 @@ typedef struct HuffmanTree {
   /* for reading only */
   unsigned char* table_len; /*length of symbol from lookup table, or max length if secondary lookup needed*/
   unsigned short* table_value; /*value of symbol from lookup table, or pointer to secondary table if needed*/
+  unsigned* table_multi; /*up to two symbols per lookup, only made for the fast inflate path, see inflateHuffmanFast*/
 } HuffmanTree;
 
 static void HuffmanTree_init(HuffmanTree* tree) {
@@ -668,6 +813,7 @@ static void HuffmanTree_init(HuffmanTree* tree) {
   tree->lengths = 0;
   tree->table_len = 0;
   tree->table_value = 0;
+  tree->table_multi = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree) {
@@ -675,6 +821,7 @@ static void HuffmanTree_cleanup(HuffmanTree* tree) {
   lodepng_free(tree->lengths);
   lodepng_free(tree->table_len);
   lodepng_free(tree->table_value);
+  lodepng_free(tree->table_multi);
 }
 
 /* amount of bits for first huffman table lookup (aka root bits), see HuffmanTree_makeTable and huffmanDecodeSymbol.*/
@@ -1109,6 +1256,70 @@ static unsigned huffmanDecodeSymbol(LodePNGBitReader* reader, const HuffmanTree*
     return codetree->table_value[index2];
   }
 }
+
+/*The fast inflate path keeps its bits in a 64-bit buffer refilled with unaligned little endian
+loads, use it on 64-bit little endian GCC-compatible compilers*/
+#if defined(__GNUC__) && defined(__SIZEOF_LONG__) && (__SIZEOF_LONG__ == 8) &&\
+    defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define LODEPNG_FAST_INFLATE
+#endif
+
+#ifdef LODEPNG_FAST_INFLATE
+/*amount of bits of a table_multi lookup*/
+#define MULTIBITS 11u
+
+/*
+make table_multi from the first table: each entry holds the bit length (bits 0-4), the amount of
+symbols (bits 5-6) and the symbols (bits 7-15 and 16-24) that the MULTIBITS next bits decode to.
+A second symbol is only present after a literal. Entries with 0 symbols must be decoded
+with the regular tables, e.g. because the code is longer than FIRSTBITS or invalid.
+*/
+static unsigned HuffmanTree_makeMultiTable(HuffmanTree* tree) {
+  static const unsigned size = 1u << MULTIBITS;
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  unsigned i;
+  tree->table_multi = (unsigned*)lodepng_malloc(size * sizeof(unsigned));
+  if(!tree->table_multi) return 83; /*alloc fail*/
+
+  for(i = 0; i != size; ++i) {
+    unsigned l1 = tree->table_len[i & mask];
+    unsigned symbol1 = tree->table_value[i & mask];
+    unsigned entry = 0;
+    if(l1 <= FIRSTBITS && symbol1 != INVALIDSYMBOL) {
+      entry = l1 | (1u << 5u) | (symbol1 << 7u);
+      if(symbol1 <= 255) {
+        /*the remaining MULTIBITS - l1 bits may hold a complete second symbol. If they are fewer than
+        FIRSTBITS, the missing high bits are zero, which is fine for codes that fit in the remaining bits
+        since the first table replicates short codes for all values of those bits*/
+        unsigned rest = (i >> l1) & mask;
+        unsigned l2 = tree->table_len[rest];
+        unsigned symbol2 = tree->table_value[rest];
+        if(l2 <= FIRSTBITS && l1 + l2 <= MULTIBITS && symbol2 != INVALIDSYMBOL) {
+          entry = (l1 + l2) | (2u << 5u) | (symbol1 << 7u) | (symbol2 << 16u);
+        }
+      }
+    }
+    tree->table_multi[i] = entry;
+  }
+  return 0;
+}
+
+/*like huffmanDecodeSymbol, but from a 64-bit bit buffer that must hold at least 15 bits*/
+static LODEPNG_INLINE unsigned huffmanDecodeWord(const HuffmanTree* codetree,
+                                                 unsigned long* bitbuf, unsigned* bitcount) {
+  unsigned code = (unsigned)(*bitbuf & ((1u << FIRSTBITS) - 1u));
+  unsigned l = codetree->table_len[code];
+  unsigned value = codetree->table_value[code];
+  if(l > FIRSTBITS) {
+    unsigned index2 = value + (unsigned)((*bitbuf >> FIRSTBITS) & ((1u << (l - FIRSTBITS)) - 1u));
+    l = codetree->table_len[index2];
+    value = codetree->table_value[index2];
+  }
+  *bitbuf >>= l;
+  *bitcount -= l;
+  return value;
+}
+#endif /*LODEPNG_FAST_INFLATE*/
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_DECODER
@@ -1258,10 +1469,122 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   return error;
 }
 
+#ifdef LODEPNG_FAST_INFLATE
+/*spare output capacity the fast path needs per symbol: a literal, the longest match and the
+overshoot of the 8-byte copies*/
+#define INFLATE_FAST_SLACK (1u + 258u + 8u)
+
+/*loads 8 more bytes into the bit buffer, leaving 56 to 63 bits in it. At least 8 input bytes must remain.*/
+#define INFLATE_FAST_REFILL() {\
+  unsigned long word;\
+  __builtin_memcpy(&word, in, 8);\
+  bitbuf |= word << bitcount;\
+  in += (63u - bitcount) >> 3u;\
+  bitcount |= 56u;\
+}
+
+/*
+Decodes the symbols of a Huffman block while at least 8 input bytes remain, so it needs no bounds
+checks on the input. Unlike the loop in inflateHuffmanBlock, it refills 64 bits at a time, which is
+enough for a whole literal/length plus distance, decodes a literal together with the next symbol in
+one table_multi lookup, and copies back-references 8 bytes at a time. Stops at the end code, setting
+*done, or near the end of the input, leaving the rest to inflateHuffmanBlock. Returns error code.
+*/
+static unsigned inflateHuffmanFast(ucvector* out, LodePNGBitReader* reader,
+                                   const HuffmanTree* tree_ll, const HuffmanTree* tree_d, unsigned* done) {
+  const unsigned char* in = reader->data + (reader->bp >> 3u);
+  const unsigned char* end = reader->data + reader->size;
+  unsigned char* data = out->data;
+  size_t pos = out->size;
+  unsigned long bitbuf = 0;
+  unsigned bitcount = 0;
+  unsigned error = 0;
+
+  if(end - in < 8) return 0;
+  INFLATE_FAST_REFILL();
+  bitbuf >>= (reader->bp & 7u);
+  bitcount -= (unsigned)(reader->bp & 7u);
+
+  while(end - in >= 8) {
+    unsigned entry, symbol;
+    INFLATE_FAST_REFILL();
+    if(out->allocsize - pos < INFLATE_FAST_SLACK) {
+      if(!ucvector_resize(out, pos + INFLATE_FAST_SLACK)) ERROR_BREAK(83 /*alloc fail*/);
+      data = out->data;
+    }
+
+    entry = tree_ll->table_multi[bitbuf & ((1u << MULTIBITS) - 1u)];
+    if(entry) {
+      bitbuf >>= (entry & 31u);
+      bitcount -= (entry & 31u);
+      symbol = (entry >> 7u) & 511u;
+      if(((entry >> 5u) & 3u) == 2u) {
+        data[pos++] = (unsigned char)symbol;
+        symbol = entry >> 16u;
+      }
+    } else {
+      symbol = huffmanDecodeWord(tree_ll, &bitbuf, &bitcount);
+    }
+
+    if(symbol <= 255) /*literal symbol*/ {
+      data[pos++] = (unsigned char)symbol;
+    } else if(symbol >= FIRST_LENGTH_CODE_INDEX && symbol <= LAST_LENGTH_CODE_INDEX) /*length code*/ {
+      unsigned code_d, numextrabits;
+      size_t length, distance, i;
+      unsigned char* dst;
+      const unsigned char* src;
+
+      length = LENGTHBASE[symbol - FIRST_LENGTH_CODE_INDEX];
+      numextrabits = LENGTHEXTRA[symbol - FIRST_LENGTH_CODE_INDEX];
+      length += (size_t)(bitbuf & ((1u << numextrabits) - 1u));
+      bitbuf >>= numextrabits;
+      bitcount -= numextrabits;
+
+      code_d = huffmanDecodeWord(tree_d, &bitbuf, &bitcount);
+      if(code_d > 29) {
+        if(code_d <= 31) {
+          ERROR_BREAK(18); /*error: invalid distance code (30-31 are never used)*/
+        } else /* if(code_d == INVALIDSYMBOL) */{
+          ERROR_BREAK(16); /*error: tried to read disallowed huffman symbol*/
+        }
+      }
+      distance = DISTANCEBASE[code_d];
+      numextrabits = DISTANCEEXTRA[code_d];
+      distance += (size_t)(bitbuf & ((1u << numextrabits) - 1u));
+      bitbuf >>= numextrabits;
+      bitcount -= numextrabits;
+
+      if(distance > pos) ERROR_BREAK(52); /*too long backward distance*/
+      dst = data + pos;
+      src = dst - distance;
+      pos += length;
+      if(distance >= 8) {
+        /*8 bytes apart or more, so every 8-byte copy reads bytes that are already final*/
+        for(i = 0; i < length; i += 8) __builtin_memcpy(dst + i, src + i, 8);
+      } else if(distance == 1) {
+        lodepng_memset(dst, *src, length);
+      } else {
+        for(i = 0; i < length; ++i) dst[i] = src[i];
+      }
+    } else if(symbol == 256) {
+      *done = 1;
+      break; /*end code, break the loop*/
+    } else /*if(symbol == INVALIDSYMBOL)*/ {
+      ERROR_BREAK(16); /*error: tried to read disallowed huffman symbol*/
+    }
+  }
+
+  out->size = pos;
+  reader->bp = (size_t)(in - reader->data) * 8u - bitcount;
+  return error;
+}
+#endif /*LODEPNG_FAST_INFLATE*/
+
 /*inflate a block with dynamic of fixed Huffman tree. btype must be 1 or 2.*/
 static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
                                     unsigned btype) {
   unsigned error = 0;
+  unsigned done = 0; /*set when the fast path already decoded the end code*/
   HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
   HuffmanTree tree_d; /*the huffman tree for distance codes*/
 
@@ -1271,7 +1594,12 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
   if(btype == 1) error = getTreeInflateFixed(&tree_ll, &tree_d);
   else /*if(btype == 2)*/ error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
 
-  while(!error) /*decode all symbols until end reached, breaks at end code*/ {
+#ifdef LODEPNG_FAST_INFLATE
+  if(!error) error = HuffmanTree_makeMultiTable(&tree_ll);
+  if(!error) error = inflateHuffmanFast(out, reader, &tree_ll, &tree_d, &done);
+#endif /*LODEPNG_FAST_INFLATE*/
+
+  while(!error && !done) /*decode all symbols until end reached, breaks at end code*/ {
     /*code_ll is literal, length or end code*/
     unsigned code_ll;
     ensureBits25(reader, 20); /* up to 15 for the huffman symbol, up to 5 for the length extra bits */
@@ -1386,23 +1714,22 @@ static unsigned lodepng_inflatev(ucvector* out,
                                  const LodePNGDecompressSettings* settings) {
   unsigned BFINAL = 0;
   LodePNGBitReader reader;
+  size_t start = out->size;
   unsigned error = LodePNGBitReader_init(&reader, in, insize);
 
-  if(error) return error;
-
-  while(!BFINAL) {
+  LODEPNG_PROBE2(inflate__entry, insize, start);
+  while(!error && !BFINAL) {
     unsigned BTYPE;
-    if(!ensureBits9(&reader, 3)) return 52; /*error, bit pointer will jump past memory*/
+    if(!ensureBits9(&reader, 3)) { error = 52; break; } /*error, bit pointer will jump past memory*/
     BFINAL = readBits(&reader, 1);
     BTYPE = readBits(&reader, 2);
 
-    if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
+    if(BTYPE == 3) error = 20; /*error: invalid BTYPE*/
     else if(BTYPE == 0) error = inflateNoCompression(out, &reader, settings); /*no compression*/
     else error = inflateHuffmanBlock(out, &reader, BTYPE); /*compression, BTYPE 01 or 10*/
-
-    if(error) return error;
   }
 
+  LODEPNG_PROBE3(inflate__return, insize, out->size - start, error);
   return error;
 }
 
@@ -1550,6 +1877,48 @@ static unsigned getHash(const unsigned char* data, size_t size, size_t pos) {
   return result & HASH_BIT_MASK;
 }
 
+/*Hash of the 4 bytes at pos, multiplicative (Knuth) hashing, for the fastmatch setting.
+Near the end of the data it falls back to getHash, 4 zero bytes hash to 0 like with getHash.*/
+static unsigned getHash4(const unsigned char* data, size_t size, size_t pos) {
+  unsigned v;
+  if(pos + 3 >= size) return getHash(data, size, pos);
+  v = (unsigned)data[pos] | ((unsigned)data[pos + 1] << 8u) |
+      ((unsigned)data[pos + 2] << 16u) | ((unsigned)data[pos + 3] << 24u);
+  return ((v * 2654435761u) >> 16u) & HASH_BIT_MASK;
+}
+
+/*Word-at-a-time comparison needs unaligned loads and count trailing zeros, use it on
+64-bit little endian GCC-compatible compilers*/
+#if defined(__GNUC__) && defined(__SIZEOF_LONG__) && (__SIZEOF_LONG__ == 8) &&\
+    defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define LODEPNG_MATCH_WORDS
+#endif
+
+/*
+Returns a pointer past the last byte of foreptr that is equal to the corresponding byte of
+backptr, stopping at lastptr. backptr must be before foreptr, so that reading it up to the
+same length stays in bounds.
+*/
+static LODEPNG_INLINE const unsigned char* matchEnd(const unsigned char* foreptr, const unsigned char* backptr,
+                                                    const unsigned char* lastptr) {
+#ifdef LODEPNG_MATCH_WORDS
+  /*XOR 8 bytes at once, the first differing byte is at the lowest set bit*/
+  while(lastptr - foreptr >= 8) {
+    unsigned long a, b;
+    __builtin_memcpy(&a, foreptr, 8);
+    __builtin_memcpy(&b, backptr, 8);
+    if(a != b) return foreptr + (__builtin_ctzl(a ^ b) >> 3u);
+    foreptr += 8;
+    backptr += 8;
+  }
+#endif /*LODEPNG_MATCH_WORDS*/
+  while(foreptr != lastptr && *backptr == *foreptr) {
+    ++backptr;
+    ++foreptr;
+  }
+  return foreptr;
+}
+
 static unsigned countZeros(const unsigned char* data, size_t size, size_t pos) {
   const unsigned char* start = data + pos;
   const unsigned char* end = start + MAX_SUPPORTED_DEFLATE_LENGTH;
@@ -1581,12 +1950,19 @@ the "dictionary". A brute force search through all possible distances would be s
 this hash technique is one out of several ways to speed this up.
 */
 static unsigned encodeLZ77(uivector* out, Hash* hash,
-                           const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching) {
+                           const unsigned char* in, size_t inpos, size_t insize,
+                           const LodePNGCompressSettings* settings) {
   size_t pos;
   unsigned i, error = 0;
+  unsigned windowsize = settings->windowsize;
+  unsigned minmatch = settings->minmatch;
+  unsigned nicematch = settings->nicematch;
+  unsigned lazymatching = settings->lazymatching;
+  unsigned goodlength = settings->goodlength;
+  unsigned fastmatch = settings->fastmatch;
   /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-  unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8u;
+  unsigned maxchainlength = settings->maxchainlength ? settings->maxchainlength :
+                            windowsize >= 8192 ? windowsize : windowsize / 8u;
   unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
 
   unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
@@ -1610,8 +1986,10 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   for(pos = inpos; pos < insize; ++pos) {
     size_t wpos = pos & (windowsize - 1); /*position for in 'circular' hash buffers*/
     unsigned chainlength = 0;
+    /*like zlib's good_length: with a good enough match pending, only search a quarter of the chain*/
+    unsigned chainlimit = (lazy && goodlength && lazylength >= goodlength) ? maxchainlength >> 2u : maxchainlength;
 
-    hashval = getHash(in, insize, pos);
+    hashval = fastmatch ? getHash4(in, insize, pos) : getHash(in, insize, pos);
 
     if(usezeros && hashval == 0) {
       if(numzeros == 0) numzeros = countZeros(in, insize, pos);
@@ -1633,7 +2011,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
     /*search for the longest string*/
     prev_offset = 0;
     for(;;) {
-      if(chainlength++ >= maxchainlength) break;
+      if(chainlength++ >= chainlimit) break;
       current_offset = (unsigned)(hashpos <= wpos ? wpos - hashpos : wpos - hashpos + windowsize);
 
       if(current_offset < prev_offset) break; /*stop when went completely around the circular buffer*/
@@ -1651,10 +2029,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
           foreptr += skip;
         }
 
-        while(foreptr != lastptr && *backptr == *foreptr) /*maximum supported length by deflate is max length*/ {
-          ++backptr;
-          ++foreptr;
-        }
+        foreptr = matchEnd(foreptr, backptr, lastptr); /*maximum supported length by deflate is max length*/
         current_length = (unsigned)(foreptr - &in[pos]);
 
         if(current_length > length) {
@@ -1714,7 +2089,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
       for(i = 1; i < length; ++i) {
         ++pos;
         wpos = pos & (windowsize - 1);
-        hashval = getHash(in, insize, pos);
+        hashval = fastmatch ? getHash4(in, insize, pos) : getHash(in, insize, pos);
         if(usezeros && hashval == 0) {
           if(numzeros == 0) numzeros = countZeros(in, insize, pos);
           else if(pos + numzeros > insize || in[pos + numzeros - 1] != 0) --numzeros;
@@ -1731,7 +2106,8 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize) {
+/*final: whether the last stored block has BFINAL set*/
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, unsigned final) {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
 
@@ -1742,7 +2118,7 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
     unsigned char firstbyte;
     size_t pos = out->size;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     LEN = 65535;
@@ -1855,8 +2231,7 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     lodepng_memset(frequencies_cl, 0, NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
 
     if(settings->use_lz77) {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings);
       if(error) break;
     } else {
       if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
@@ -2041,8 +2416,7 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
     if(settings->use_lz77) /*LZ77 encoded*/ {
       uivector lz77_encoded;
       uivector_init(&lz77_encoded);
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings);
       if(!error) writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
       uivector_cleanup(&lz77_encoded);
     } else /*no LZ77, but still will be Huffman compressed*/ {
@@ -2061,39 +2435,65 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings) {
+/*Adds the positions [start - windowsize, start) to the hash, so that the LZ77 encoder
+can find matches in the data preceding start when it begins a fresh hash there.*/
+static void hash_prime(Hash* hash, const unsigned char* in, size_t start,
+                       const LodePNGCompressSettings* settings) {
+  unsigned windowsize = settings->windowsize;
+  size_t pos = start > windowsize ? start - windowsize : 0;
+  unsigned numzeros = 0;
+  for(; pos < start; ++pos) {
+    unsigned hashval = settings->fastmatch ? getHash4(in, start, pos) : getHash(in, start, pos);
+    if(hashval == 0) {
+      if(numzeros == 0) numzeros = countZeros(in, start, pos);
+      else if(pos + numzeros > start || in[pos + numzeros - 1] != 0) --numzeros;
+    } else {
+      numzeros = 0;
+    }
+    updateHashChain(hash, pos & (windowsize - 1), hashval, (unsigned short)numzeros);
+  }
+}
+
+/*
+Deflates in[start..end) as deflate blocks of at most blocksize bytes, appended to out.
+If final, the last block has BFINAL set. Otherwise the output is ended with an empty
+stored block (like zlib's Z_SYNC_FLUSH), which pads it to a byte boundary so that the
+deflate data of the next chunk can simply be appended to it. Back references may reach
+into the windowsize bytes before start.
+*/
+static unsigned deflateChunk(ucvector* out, const unsigned char* in, size_t start, size_t end,
+                             size_t blocksize, const LodePNGCompressSettings* settings, unsigned final) {
   unsigned error = 0;
-  size_t i, blocksize, numdeflateblocks;
   Hash hash;
   LodePNGBitWriter writer;
 
   LodePNGBitWriter_init(&writer, out);
 
-  if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
-  else /*if(settings->btype == 2)*/ {
-    /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
-    blocksize = insize / 8u + 8;
-    if(blocksize < 65536) blocksize = 65536;
-    if(blocksize > 262144) blocksize = 262144;
-  }
-
-  numdeflateblocks = (insize + blocksize - 1) / blocksize;
-  if(numdeflateblocks == 0) numdeflateblocks = 1;
-
   error = hash_init(&hash, settings->windowsize);
+  if(!error && settings->use_lz77 && start > 0) hash_prime(&hash, in, start, settings);
 
   if(!error) {
-    for(i = 0; i != numdeflateblocks && !error; ++i) {
-      unsigned final = (i == numdeflateblocks - 1);
-      size_t start = i * blocksize;
-      size_t end = start + blocksize;
-      if(end > insize) end = insize;
-
-      if(settings->btype == 1) error = deflateFixed(&writer, &hash, in, start, end, settings, final);
-      else if(settings->btype == 2) error = deflateDynamic(&writer, &hash, in, start, end, settings, final);
+    size_t blockstart = start;
+    do {
+      size_t blockend = end - blockstart > blocksize ? blockstart + blocksize : end;
+      unsigned finalblock = final && (blockend == end);
+
+      if(settings->btype == 1) error = deflateFixed(&writer, &hash, in, blockstart, blockend, settings, finalblock);
+      else error = deflateDynamic(&writer, &hash, in, blockstart, blockend, settings, finalblock);
+      blockstart = blockend;
+    } while(blockstart != end && !error);
+  }
+
+  if(!error && !final) {
+    size_t pos;
+    writeBits(&writer, 0, 3); /*BFINAL 0 and BTYPE 00, the remaining bits of the byte stay 0*/
+    pos = out->size;
+    if(!ucvector_resize(out, pos + 4)) error = 83; /*alloc fail*/
+    else {
+      out->data[pos + 0] = 0;
+      out->data[pos + 1] = 0;
+      out->data[pos + 2] = 255;
+      out->data[pos + 3] = 255;
     }
   }
 
@@ -2102,6 +2502,92 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   return error;
 }
 
+typedef struct DeflateChunks {
+  const unsigned char* in;
+  size_t insize;
+  size_t chunksize;
+  const LodePNGCompressSettings* settings;
+  ucvector* outputs; /*one per chunk*/
+  unsigned* errors; /*one per chunk*/
+} DeflateChunks;
+
+static void deflateChunkTask(void* context, size_t index) {
+  DeflateChunks* chunks = (DeflateChunks*)context;
+  size_t start = index * chunks->chunksize;
+  size_t end = start + chunks->chunksize;
+  unsigned final = end >= chunks->insize;
+  if(final) end = chunks->insize;
+  /*one deflate block per chunk*/
+  chunks->errors[index] = deflateChunk(&chunks->outputs[index], chunks->in, start, end,
+                                       chunks->chunksize, chunks->settings, final);
+}
+
+/*
+Deflate with settings->numthreads threads, pigz style: every chunk is compressed
+independently with the preceding window as dictionary, and the chunk outputs are
+concatenated, giving one valid deflate stream.
+*/
+static unsigned deflateParallel(ucvector* out, const unsigned char* in, size_t insize,
+                                size_t chunksize, const LodePNGCompressSettings* settings) {
+  unsigned error = 0;
+  size_t i, numchunks = (insize + chunksize - 1) / chunksize;
+  DeflateChunks chunks;
+
+  chunks.in = in;
+  chunks.insize = insize;
+  chunks.chunksize = chunksize;
+  chunks.settings = settings;
+  chunks.outputs = (ucvector*)lodepng_malloc(sizeof(ucvector) * numchunks);
+  chunks.errors = (unsigned*)lodepng_malloc(sizeof(unsigned) * numchunks);
+  if(!chunks.outputs || !chunks.errors) {
+    lodepng_free(chunks.outputs);
+    lodepng_free(chunks.errors);
+    return 83; /*alloc fail*/
+  }
+  for(i = 0; i != numchunks; ++i) chunks.outputs[i] = ucvector_init(NULL, 0);
+
+  lodepng_parallel_for(numchunks, settings->numthreads, deflateChunkTask, &chunks);
+
+  for(i = 0; i != numchunks && !error; ++i) {
+    size_t pos = out->size;
+    error = chunks.errors[i];
+    if(error) break;
+    if(!ucvector_resize(out, pos + chunks.outputs[i].size)) ERROR_BREAK(83); /*alloc fail*/
+    lodepng_memcpy(out->data + pos, chunks.outputs[i].data, chunks.outputs[i].size);
+  }
+
+  for(i = 0; i != numchunks; ++i) lodepng_free(chunks.outputs[i].data);
+  lodepng_free(chunks.outputs);
+  lodepng_free(chunks.errors);
+
+  return error;
+}
+
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings) {
+  size_t blocksize;
+  size_t start = out->size;
+  unsigned error;
+
+  LODEPNG_PROBE2(deflate__entry, insize, settings->btype);
+  /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
+  blocksize = insize / 8u + 8;
+  if(blocksize < 65536) blocksize = 65536;
+  if(blocksize > 262144) blocksize = 262144;
+
+  if(settings->btype > 2) error = 61;
+  else if(settings->btype == 0) error = deflateNoCompression(out, in, insize, 1);
+  else if(insize > blocksize && lodepng_get_numthreads(settings->numthreads) > 1) {
+    error = deflateParallel(out, in, insize, blocksize, settings);
+  } else {
+    if(settings->btype == 1) blocksize = insize;
+    error = deflateChunk(out, in, 0, insize, blocksize == 0 ? 1 : blocksize, settings, 1);
+  }
+
+  LODEPNG_PROBE3(deflate__return, insize, out->size - start, error);
+  return error;
+}
+
 unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings) {
@@ -2128,31 +2614,204 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len) {
+/*largest n such that 255n(n+1)/2 + (n+1)(65521-1) <= 2^32-1: at least this many
+sums can be done before the sums overflow, saving a lot of modulo divisions*/
+#define ADLER32_NMAX 5552u
+#define ADLER32_BASE 65521u
+
+static unsigned update_adler32_scalar(unsigned adler, const unsigned char* data, unsigned len) {
   unsigned s1 = adler & 0xffffu;
   unsigned s2 = (adler >> 16u) & 0xffffu;
 
   while(len != 0u) {
     unsigned i;
-    /*at least 5552 sums can be done before the sums overflow, saving a lot of module divisions*/
-    unsigned amount = len > 5552u ? 5552u : len;
+    unsigned amount = len > ADLER32_NMAX ? ADLER32_NMAX : len;
     len -= amount;
     for(i = 0; i != amount; ++i) {
       s1 += (*data++);
       s2 += s1;
     }
-    s1 %= 65521u;
-    s2 %= 65521u;
+    s1 %= ADLER32_BASE;
+    s2 %= ADLER32_BASE;
   }
 
   return (s2 << 16u) | s1;
 }
 
+#ifdef LODEPNG_SIMD_X86
+/*
+Vectorized adler32, processing 32 bytes per step. For a block of bytes d[0..31]
+added to the running sums, s1 grows by sum(d[i]) and s2 grows by 32 * s1 (the
+s1 from before the block) plus the dot product of d with the taps 32, 31, ..., 1.
+The byte sums come from psadbw, the dot product from pmaddubsw followed by pmaddwd,
+and the 32 * s1 terms are accumulated in v_ps and shifted in at the end of each
+chunk of at most ADLER32_NMAX bytes, after which both sums are reduced modulo BASE.
+The remaining len % 32 bytes are done by the scalar loop.
+*/
+LODEPNG_TARGET("ssse3")
+static unsigned update_adler32_ssse3(unsigned adler, const unsigned char* data, unsigned len) {
+  unsigned s1 = adler & 0xffffu;
+  unsigned s2 = (adler >> 16u) & 0xffffu;
+  unsigned blocks = len / 32u;
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+
+  len -= blocks * 32u;
+  while(blocks != 0u) {
+    unsigned n = ADLER32_NMAX / 32u;
+    __m128i v_ps, v_s1, v_s2;
+    if(n > blocks) n = blocks;
+    blocks -= n;
+
+    v_ps = _mm_set_epi32(0, 0, 0, (int)(s1 * n));
+    v_s2 = _mm_set_epi32(0, 0, 0, (int)s2);
+    v_s1 = zero;
+    do {
+      const __m128i bytes1 = _mm_loadu_si128((const __m128i*)data);
+      const __m128i bytes2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      data += 32;
+    } while(--n);
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+    /*horizontal sums of the four 32-bit lanes*/
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 += (unsigned)_mm_cvtsi128_si32(v_s1);
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s2 = (unsigned)_mm_cvtsi128_si32(v_s2);
+
+    s1 %= ADLER32_BASE;
+    s2 %= ADLER32_BASE;
+  }
+
+  return update_adler32_scalar((s2 << 16u) | s1, data, len);
+}
+
+/*same as update_adler32_ssse3, with the 32-byte block in a single register*/
+LODEPNG_TARGET("avx2")
+static unsigned update_adler32_avx2(unsigned adler, const unsigned char* data, unsigned len) {
+  unsigned s1 = adler & 0xffffu;
+  unsigned s2 = (adler >> 16u) & 0xffffu;
+  unsigned blocks = len / 32u;
+  const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                       16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+
+  len -= blocks * 32u;
+  while(blocks != 0u) {
+    unsigned n = ADLER32_NMAX / 32u;
+    __m256i v_ps, v_s1, v_s2;
+    __m128i h;
+    if(n > blocks) n = blocks;
+    blocks -= n;
+
+    v_ps = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, (int)(s1 * n));
+    v_s2 = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, (int)s2);
+    v_s1 = zero;
+    do {
+      const __m256i bytes = _mm256_loadu_si256((const __m256i*)data);
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+      data += 32;
+    } while(--n);
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+    /*horizontal sums of the eight 32-bit lanes*/
+    h = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+    h = _mm_add_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(2, 3, 0, 1)));
+    h = _mm_add_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 += (unsigned)_mm_cvtsi128_si32(h);
+    h = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+    h = _mm_add_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(2, 3, 0, 1)));
+    h = _mm_add_epi32(h, _mm_shuffle_epi32(h, _MM_SHUFFLE(1, 0, 3, 2)));
+    s2 = (unsigned)_mm_cvtsi128_si32(h);
+
+    s1 %= ADLER32_BASE;
+    s2 %= ADLER32_BASE;
+  }
+
+  return update_adler32_scalar((s2 << 16u) | s1, data, len);
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len) {
+#ifdef LODEPNG_SIMD_X86
+  /*short inputs are not worth the setup and horizontal sums of the vector kernels*/
+  if(len >= 64u) {
+    if(__builtin_cpu_supports("avx2")) return update_adler32_avx2(adler, data, len);
+    if(__builtin_cpu_supports("ssse3")) return update_adler32_ssse3(adler, data, len);
+  }
+#endif /*LODEPNG_SIMD_X86*/
+  return update_adler32_scalar(adler, data, len);
+}
+
 /*Return the adler32 of the bytes data[0..len-1]*/
 static unsigned adler32(const unsigned char* data, unsigned len) {
   return update_adler32(1u, data, len);
 }
 
+#ifdef LODEPNG_COMPILE_ENCODER
+/*Returns the adler32 of the concatenation of two byte sequences, from the adler32 of
+each of them and the length of the second one, see zlib's adler32_combine.*/
+static unsigned adler32_combine(unsigned adler1, unsigned adler2, size_t len2) {
+  unsigned rem = (unsigned)(len2 % ADLER32_BASE);
+  unsigned s1 = adler1 & 0xffffu;
+  unsigned s2 = (unsigned)(((unsigned long)rem * s1) % ADLER32_BASE);
+  s1 += (adler2 & 0xffffu) + ADLER32_BASE - 1u;
+  s2 += ((adler1 >> 16u) & 0xffffu) + ((adler2 >> 16u) & 0xffffu) + ADLER32_BASE - rem;
+  if(s1 >= ADLER32_BASE) s1 -= ADLER32_BASE;
+  if(s1 >= ADLER32_BASE) s1 -= ADLER32_BASE;
+  if(s2 >= (ADLER32_BASE << 1u)) s2 -= (ADLER32_BASE << 1u);
+  if(s2 >= ADLER32_BASE) s2 -= ADLER32_BASE;
+  return (s2 << 16u) | s1;
+}
+
+#define ADLER32_CHUNKSIZE 1048576u
+
+typedef struct Adler32Chunks {
+  const unsigned char* data;
+  size_t len;
+  unsigned* sums; /*adler32 of each chunk*/
+} Adler32Chunks;
+
+static void adler32ChunkTask(void* context, size_t index) {
+  Adler32Chunks* chunks = (Adler32Chunks*)context;
+  size_t start = index * ADLER32_CHUNKSIZE;
+  size_t len = chunks->len - start > ADLER32_CHUNKSIZE ? ADLER32_CHUNKSIZE : chunks->len - start;
+  chunks->sums[index] = adler32(chunks->data + start, (unsigned)len);
+}
+
+/*adler32 of data[0..len-1], with chunks computed on up to numthreads threads and combined*/
+static unsigned adler32_parallel(const unsigned char* data, size_t len, unsigned numthreads) {
+  size_t i, numchunks = (len + ADLER32_CHUNKSIZE - 1u) / ADLER32_CHUNKSIZE;
+  unsigned result;
+  Adler32Chunks chunks;
+  if(numchunks < 2 || lodepng_get_numthreads(numthreads) < 2) return adler32(data, (unsigned)len);
+  chunks.data = data;
+  chunks.len = len;
+  chunks.sums = (unsigned*)lodepng_malloc(sizeof(unsigned) * numchunks);
+  if(!chunks.sums) return adler32(data, (unsigned)len);
+  lodepng_parallel_for(numchunks, numthreads, adler32ChunkTask, &chunks);
+  result = chunks.sums[0];
+  for(i = 1; i != numchunks; ++i) {
+    size_t chunklen = i + 1 == numchunks ? len - i * ADLER32_CHUNKSIZE : ADLER32_CHUNKSIZE;
+    result = adler32_combine(result, chunks.sums[i], chunklen);
+  }
+  lodepng_free(chunks.sums);
+  return result;
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Zlib                                                                   / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -2192,8 +2851,10 @@ static unsigned lodepng_zlib_decompressv(ucvector* out,
   if(error) return error;
 
   if(!settings->ignore_adler32) {
-    unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
-    unsigned checksum = adler32(out->data, (unsigned)(out->size));
+    unsigned ADLER32, checksum;
+    if(insize < 6) return 58; /*error, no room for the adler checksum after the header and data*/
+    ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
+    checksum = adler32(out->data, (unsigned)(out->size));
     if(checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
   }
 
@@ -2252,7 +2913,7 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   }
 
   if(!error) {
-    unsigned ADLER32 = adler32(in, (unsigned)insize);
+    unsigned ADLER32 = adler32_parallel(in, insize, settings->numthreads);
     /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
     unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
     unsigned FLEVEL = 0;
@@ -2318,13 +2979,17 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings) {
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->maxchainlength = 0;
+  settings->goodlength = 0;
+  settings->fastmatch = 0;
+  settings->numthreads = 1;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 1, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -4971,15 +5636,14 @@ unsigned lodepng_decode24(unsigned char** out, unsigned* w, unsigned* h, const u
 #ifdef LODEPNG_COMPILE_DISK
 unsigned lodepng_decode_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename,
                              LodePNGColorType colortype, unsigned bitdepth) {
-  unsigned char* buffer = 0;
-  size_t buffersize;
+  LodePNGFileView view;
   unsigned error;
   /* safe output values in case error happens */
   *out = 0;
   *w = *h = 0;
-  error = lodepng_load_file(&buffer, &buffersize, filename);
-  if(!error) error = lodepng_decode_memory(out, w, h, buffer, buffersize, colortype, bitdepth);
-  lodepng_free(buffer);
+  error = lodepng_map_file(&view, filename);
+  if(!error) error = lodepng_decode_memory(out, w, h, view.data, view.size, colortype, bitdepth);
+  lodepng_unmap_file(&view);
   return error;
 }
 
@@ -5397,8 +6061,103 @@ static size_t ilog2i(size_t i) {
   return i * l + ((i - (1u << l)) << 1u);
 }
 
+/*
+Adaptive filtering of numrows scanlines for LFS_MINSUM or LFS_ENTROPY: each row of in is
+filtered with all 5 filter types into attempt[0..4] (buffers of linebytes each), and the
+best one is written to out with its filter type byte. prevline is the input row before the
+first one, or NULL for the top of the image. The choice for a row depends only on that row
+and the previous input row, so disjoint row ranges can be filtered independently.
+*/
+static void filterAdaptive(unsigned char* out, const unsigned char* in, const unsigned char* prevline,
+                           size_t linebytes, size_t bytewidth, unsigned numrows,
+                           LodePNGFilterStrategy strategy, unsigned char* attempt[5]) {
+  size_t x;
+  unsigned y;
+  unsigned type, bestType = 0;
+  size_t bestSum = 0;
+  unsigned count[256];
+
+  for(y = 0; y != numrows; ++y) {
+    /*try the 5 filter types*/
+    for(type = 0; type != 5; ++type) {
+      size_t sum = 0;
+      filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, (unsigned char)type);
+
+      if(strategy == LFS_MINSUM) {
+        /*calculate the sum of the result*/
+        if(type == 0) {
+          for(x = 0; x != linebytes; ++x) sum += (unsigned char)(attempt[type][x]);
+        } else {
+          for(x = 0; x != linebytes; ++x) {
+            /*For differences, each byte should be treated as signed, values above 127 are negative
+            (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
+            This means filtertype 0 is almost never chosen, but that is justified.*/
+            unsigned char s = attempt[type][x];
+            sum += s < 128 ? s : (255U - s);
+          }
+        }
+
+        /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
+        if(type == 0 || sum < bestSum) {
+          bestType = type;
+          bestSum = sum;
+        }
+      } else /*LFS_ENTROPY*/ {
+        lodepng_memset(count, 0, 256 * sizeof(*count));
+        for(x = 0; x != linebytes; ++x) ++count[attempt[type][x]];
+        ++count[type]; /*the filter type itself is part of the scanline*/
+        for(x = 0; x != 256; ++x) {
+          sum += ilog2i(count[x]);
+        }
+        /*check if this is largest sum (or if type == 0 it's the first case so always store the values)*/
+        if(type == 0 || sum > bestSum) {
+          bestType = type;
+          bestSum = sum;
+        }
+      }
+    }
+
+    prevline = &in[y * linebytes];
+
+    /*now fill the out values*/
+    out[y * (linebytes + 1)] = (unsigned char)bestType; /*the first byte of a scanline will be the filter type*/
+    lodepng_memcpy(&out[y * (linebytes + 1) + 1], attempt[bestType], linebytes);
+  }
+}
+
+/*filtering of large images is split in bands of rows of at least this many bytes for multithreading*/
+#define FILTER_MIN_BAND_BYTES 65536u
+
+typedef struct FilterBands {
+  unsigned char* out;
+  const unsigned char* in;
+  size_t linebytes;
+  size_t bytewidth;
+  unsigned h;
+  size_t numbands;
+  LodePNGFilterStrategy strategy;
+  unsigned char* scratch; /*5 attempt buffers of linebytes for each band*/
+} FilterBands;
+
+static void filterBandTask(void* context, size_t index) {
+  FilterBands* bands = (FilterBands*)context;
+  unsigned ystart = (unsigned)(bands->h * index / bands->numbands);
+  unsigned yend = (unsigned)(bands->h * (index + 1) / bands->numbands);
+  unsigned char* attempt[5];
+  unsigned type;
+  for(type = 0; type != 5; ++type) attempt[type] = bands->scratch + (index * 5 + type) * bands->linebytes;
+  filterAdaptive(&bands->out[ystart * (bands->linebytes + 1)], &bands->in[ystart * bands->linebytes],
+                 ystart == 0 ? 0 : &bands->in[(ystart - 1) * bands->linebytes],
+                 bands->linebytes, bands->bytewidth, yend - ystart, bands->strategy, attempt);
+}
+
+/*
+scratch: buffer for the filter attempts of the adaptive strategies. It is resized as needed and
+reused, so that the encoder allocates it once for all Adam7 passes. The caller frees it.
+*/
 static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings,
+                       ucvector* scratch) {
   /*
   For PNG filter method 0
   out must be a buffer with as size: h + (w * h * bpp + 7u) / 8u, because there are
@@ -5443,92 +6202,26 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type);
       prevline = &in[inindex];
     }
-  } else if(strategy == LFS_MINSUM) {
-    /*adaptive filtering*/
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
-    size_t smallest = 0;
-    unsigned char type, bestType = 0;
-
-    for(type = 0; type != 5; ++type) {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) error = 83; /*alloc fail*/
-    }
-
-    if(!error) {
-      for(y = 0; y != h; ++y) {
-        /*try the 5 filter types*/
-        for(type = 0; type != 5; ++type) {
-          size_t sum = 0;
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          if(type == 0) {
-            for(x = 0; x != linebytes; ++x) sum += (unsigned char)(attempt[type][x]);
-          } else {
-            for(x = 0; x != linebytes; ++x) {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type][x];
-              sum += s < 128 ? s : (255U - s);
-            }
-          }
-
-          /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum < smallest) {
-            bestType = type;
-            smallest = sum;
-          }
-        }
-
-        prevline = &in[y * linebytes];
-
-        /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
-      }
-    }
-
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
-  } else if(strategy == LFS_ENTROPY) {
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
-    size_t bestSum = 0;
-    unsigned type, bestType = 0;
-    unsigned count[256];
-
-    for(type = 0; type != 5; ++type) {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) error = 83; /*alloc fail*/
-    }
-
-    if(!error) {
-      for(y = 0; y != h; ++y) {
-        /*try the 5 filter types*/
-        for(type = 0; type != 5; ++type) {
-          size_t sum = 0;
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-          lodepng_memset(count, 0, 256 * sizeof(*count));
-          for(x = 0; x != linebytes; ++x) ++count[attempt[type][x]];
-          ++count[type]; /*the filter type itself is part of the scanline*/
-          for(x = 0; x != 256; ++x) {
-            sum += ilog2i(count[x]);
-          }
-          /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum > bestSum) {
-            bestType = type;
-            bestSum = sum;
-          }
-        }
-
-        prevline = &in[y * linebytes];
-
-        /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
-      }
-    }
-
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+  } else if(strategy == LFS_MINSUM || strategy == LFS_ENTROPY) {
+    /*adaptive filtering, in bands of rows on multiple threads for large images*/
+    FilterBands bands;
+    size_t numbands = lodepng_get_numthreads(settings->zlibsettings.numthreads);
+    size_t maxbands = linebytes * h / FILTER_MIN_BAND_BYTES;
+    if(numbands > maxbands) numbands = maxbands;
+    if(numbands > h) numbands = h;
+    if(numbands == 0) numbands = 1;
+
+    if(!ucvector_resize(scratch, numbands * 5 * linebytes)) return 83; /*alloc fail*/
+
+    bands.out = out;
+    bands.in = in;
+    bands.linebytes = linebytes;
+    bands.bytewidth = bytewidth;
+    bands.h = h;
+    bands.numbands = numbands;
+    bands.strategy = strategy;
+    bands.scratch = scratch->data;
+    lodepng_parallel_for(numbands, settings->zlibsettings.numthreads, filterBandTask, &bands);
   } else if(strategy == LFS_PREDEFINED) {
     for(y = 0; y != h; ++y) {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
@@ -5558,33 +6251,28 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     images only, so disable it*/
     zlibsettings.custom_zlib = 0;
     zlibsettings.custom_deflate = 0;
-    for(type = 0; type != 5; ++type) {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) error = 83; /*alloc fail*/
-    }
-    if(!error) {
-      for(y = 0; y != h; ++y) /*try the 5 filter types*/ {
-        for(type = 0; type != 5; ++type) {
-          unsigned testsize = (unsigned)linebytes;
-          /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
-
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-          size[type] = 0;
-          dummy = 0;
-          zlib_compress(&dummy, &size[type], attempt[type], testsize, &zlibsettings);
-          lodepng_free(dummy);
-          /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || size[type] < smallest) {
-            bestType = type;
-            smallest = size[type];
-          }
+    if(!ucvector_resize(scratch, 5 * linebytes)) return 83; /*alloc fail*/
+    for(type = 0; type != 5; ++type) attempt[type] = scratch->data + type * linebytes;
+    for(y = 0; y != h; ++y) /*try the 5 filter types*/ {
+      for(type = 0; type != 5; ++type) {
+        unsigned testsize = (unsigned)linebytes;
+        /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
+
+        filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
+        size[type] = 0;
+        dummy = 0;
+        zlib_compress(&dummy, &size[type], attempt[type], testsize, &zlibsettings);
+        lodepng_free(dummy);
+        /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
+        if(type == 0 || size[type] < smallest) {
+          bestType = type;
+          smallest = size[type];
         }
-        prevline = &in[y * linebytes];
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
       }
+      prevline = &in[y * linebytes];
+      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+      for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
     }
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
   }
   else return 88; /* unknown filter strategy */
 
@@ -5672,6 +6360,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
   */
   unsigned bpp = lodepng_get_bpp(&info_png->color);
   unsigned error = 0;
+  ucvector scratch = ucvector_init(NULL, 0); /*filter attempts, shared by all passes*/
 
   if(info_png->interlace_method == 0) {
     *outsize = h + (h * ((w * bpp + 7u) / 8u)); /*image size plus an extra byte per scanline + possible padding bits*/
@@ -5685,12 +6374,12 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
         if(!padded) error = 83; /*alloc fail*/
         if(!error) {
           addPaddingBits(padded, in, ((w * bpp + 7u) / 8u) * 8u, w * bpp, h);
-          error = filter(*out, padded, w, h, &info_png->color, settings);
+          error = filter(*out, padded, w, h, &info_png->color, settings, &scratch);
         }
         lodepng_free(padded);
       } else {
         /*we can immediately filter into the out buffer, no other steps needed*/
-        error = filter(*out, in, w, h, &info_png->color, settings);
+        error = filter(*out, in, w, h, &info_png->color, settings, &scratch);
       }
     }
   } else /*interlace_method is 1 (Adam7)*/ {
@@ -5718,11 +6407,11 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
           addPaddingBits(padded, &adam7[passstart[i]],
                          ((passw[i] * bpp + 7u) / 8u) * 8u, passw[i] * bpp, passh[i]);
           error = filter(&(*out)[filter_passstart[i]], padded,
-                         passw[i], passh[i], &info_png->color, settings);
+                         passw[i], passh[i], &info_png->color, settings, &scratch);
           lodepng_free(padded);
         } else {
           error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]],
-                         passw[i], passh[i], &info_png->color, settings);
+                         passw[i], passh[i], &info_png->color, settings, &scratch);
         }
 
         if(error) break;
@@ -5732,6 +6421,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
     lodepng_free(adam7);
   }
 
+  lodepng_free(scratch.data);
   return error;
 }
 
@@ -6028,6 +6718,278 @@ cleanup:
   return state->error;
 }
 
+#ifdef LODEPNG_COMPILE_ZLIB
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Streaming PNG Encoder                                                  / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*IDAT chunk data size used when 0 is given to lodepng_stream_encoder_begin*/
+#define DEFAULT_STREAM_IDATSIZE 65536u
+
+struct LodePNGStreamEncoder {
+  LodePNGStreamSink sink;
+  void* context;
+  LodePNGEncoderSettings settings; /*predefined_filters points to filters*/
+  unsigned char* filters; /*copy of the h predefined filter types, for LFS_PREDEFINED*/
+  LodePNGFilterStrategy strategy; /*settings->filter_strategy after the palette_zero heuristic*/
+  unsigned w, h;
+  unsigned y; /*number of rows received so far*/
+  size_t linebytes; /*bytes per row, without filter type byte*/
+  size_t bytewidth;
+  size_t blocksize; /*filtered bytes per deflate block*/
+  size_t idatsize;
+  unsigned char* prevline; /*copy of the last received row, valid if y > 0*/
+  ucvector attempts; /*the 5 filter attempts for adaptive filtering*/
+  ucvector window; /*filtered data: LZ77 history followed by the data not yet deflated*/
+  size_t windowpos; /*start of the data not yet deflated in window*/
+  Hash hash;
+  ucvector compressed; /*zlib data not yet output. If writer.bp is not at a byte boundary, the last byte is partial*/
+  LodePNGBitWriter writer;
+  ucvector chunk; /*buffer for the chunk being output*/
+  unsigned adler;
+  unsigned error; /*first error that happened, every later call returns it*/
+};
+
+static unsigned streamEmit(LodePNGStreamEncoder* encoder, const ucvector* data) {
+  return encoder->sink(encoder->context, data->data, data->size);
+}
+
+/*Outputs IDAT chunks of idatsize from the complete bytes of compressed. If final, also
+outputs the rest in a last, smaller, IDAT chunk.*/
+static unsigned streamEmitIDAT(LodePNGStreamEncoder* encoder, unsigned final) {
+  ucvector* compressed = &encoder->compressed;
+  size_t complete = compressed->size - ((!final && (encoder->writer.bp & 7u)) ? 1u : 0u);
+  size_t pos = 0;
+  while(complete - pos >= encoder->idatsize || (final && pos != complete)) {
+    size_t size = complete - pos > encoder->idatsize ? encoder->idatsize : complete - pos;
+    encoder->chunk.size = 0;
+    CERROR_TRY_RETURN(lodepng_chunk_createv(&encoder->chunk, size, "IDAT", compressed->data + pos));
+    CERROR_TRY_RETURN(streamEmit(encoder, &encoder->chunk));
+    pos += size;
+  }
+  /*keep what was not output, including the partial byte the bit writer continues in*/
+  if(pos) {
+    size_t i;
+    for(i = pos; i != compressed->size; ++i) compressed->data[i - pos] = compressed->data[i];
+    compressed->size -= pos;
+  }
+  return 0;
+}
+
+/*Deflates the pending filtered data up to dataend as one deflate block, and drops history
+the LZ77 window no longer needs.*/
+static unsigned streamDeflate(LodePNGStreamEncoder* encoder, size_t dataend, unsigned final) {
+  const LodePNGCompressSettings* zlibsettings = &encoder->settings.zlibsettings;
+  ucvector* window = &encoder->window;
+  unsigned windowsize = zlibsettings->windowsize;
+  unsigned error = 0;
+
+  if(zlibsettings->btype == 0) {
+    error = deflateNoCompression(&encoder->compressed, window->data + encoder->windowpos,
+                                 dataend - encoder->windowpos, final);
+  } else if(zlibsettings->btype == 1) {
+    error = deflateFixed(&encoder->writer, &encoder->hash, window->data, encoder->windowpos, dataend,
+                         zlibsettings, final);
+  } else {
+    error = deflateDynamic(&encoder->writer, &encoder->hash, window->data, encoder->windowpos, dataend,
+                           zlibsettings, final);
+  }
+  if(error) return error;
+  encoder->windowpos = dataend;
+
+  /*Keep at least windowsize bytes of history. The hash only stores positions modulo
+  windowsize, so shifting by a multiple of it keeps the hash valid.*/
+  if(encoder->windowpos >= 2u * (size_t)windowsize) {
+    size_t shift = (encoder->windowpos - windowsize) & ~((size_t)windowsize - 1u);
+    size_t i;
+    for(i = shift; i != window->size; ++i) window->data[i - shift] = window->data[i];
+    window->size -= shift;
+    encoder->windowpos -= shift;
+  }
+
+  return streamEmitIDAT(encoder, 0);
+}
+
+unsigned lodepng_stream_encoder_begin(LodePNGStreamEncoder** encoder, unsigned w, unsigned h,
+                                      const LodePNGState* state, size_t idatsize,
+                                      LodePNGStreamSink sink, void* context) {
+  LodePNGStreamEncoder* e;
+  const LodePNGColorMode* color = &state->info_png.color;
+  const LodePNGCompressSettings* zlibsettings = &state->encoder.zlibsettings;
+  unsigned bpp = lodepng_get_bpp(color);
+  size_t filteredsize;
+  ucvector header = ucvector_init(NULL, 0);
+  unsigned error = 0;
+
+  *encoder = 0;
+  if(w == 0 || h == 0) return 93;
+  CERROR_TRY_RETURN(checkColorValidity(color->colortype, color->bitdepth));
+  if(color->colortype == LCT_PALETTE && (color->palettesize == 0 || color->palettesize > 256)) return 68;
+  if(zlibsettings->btype > 2) return 61;
+  /*the window is also used to bound the history kept, so it must be valid even if LZ77 is off*/
+  if(zlibsettings->windowsize == 0 || zlibsettings->windowsize > 32768) return 60;
+  if((zlibsettings->windowsize & (zlibsettings->windowsize - 1)) != 0) return 90;
+  if(state->info_png.interlace_method != 0) return 109;
+  if(state->encoder.filter_strategy == LFS_BRUTE_FORCE) return 109;
+  if(lodepng_mulofl(lodepng_get_raw_size_idat(w, 1, bpp), h, &filteredsize)) return 92;
+
+  e = (LodePNGStreamEncoder*)lodepng_malloc(sizeof(LodePNGStreamEncoder));
+  if(!e) return 83; /*alloc fail*/
+  e->sink = sink;
+  e->context = context;
+  lodepng_memcpy(&e->settings, &state->encoder, sizeof(LodePNGEncoderSettings));
+  e->filters = 0;
+  e->settings.predefined_filters = 0;
+  e->strategy = state->encoder.filter_strategy;
+  if(state->encoder.filter_palette_zero &&
+     (color->colortype == LCT_PALETTE || color->bitdepth < 8)) e->strategy = LFS_ZERO;
+  e->w = w;
+  e->h = h;
+  e->y = 0;
+  e->linebytes = lodepng_get_raw_size_idat(w, 1, bpp) - 1u;
+  e->bytewidth = (bpp + 7u) / 8u;
+  /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding, same as lodepng_deflatev*/
+  e->blocksize = filteredsize / 8u + 8;
+  if(e->blocksize < 65536) e->blocksize = 65536;
+  if(e->blocksize > 262144) e->blocksize = 262144;
+  e->idatsize = idatsize ? idatsize : DEFAULT_STREAM_IDATSIZE;
+  e->prevline = (unsigned char*)lodepng_malloc(e->linebytes);
+  e->attempts = ucvector_init(NULL, 0);
+  e->window = ucvector_init(NULL, 0);
+  e->windowpos = 0;
+  e->compressed = ucvector_init(NULL, 0);
+  LodePNGBitWriter_init(&e->writer, &e->compressed);
+  e->chunk = ucvector_init(NULL, 0);
+  e->adler = 1u;
+  e->error = 0;
+  *encoder = e;
+
+  error = hash_init(&e->hash, zlibsettings->windowsize);
+  if(!error && !e->prevline) error = 83; /*alloc fail*/
+  if(!error && (e->strategy == LFS_MINSUM || e->strategy == LFS_ENTROPY)) {
+    if(!ucvector_resize(&e->attempts, 5 * e->linebytes)) error = 83; /*alloc fail*/
+  }
+  if(!error && e->strategy == LFS_PREDEFINED) {
+    e->filters = (unsigned char*)lodepng_malloc(h);
+    if(!e->filters) error = 83; /*alloc fail*/
+    else {
+      lodepng_memcpy(e->filters, state->encoder.predefined_filters, h);
+      e->settings.predefined_filters = e->filters;
+    }
+  }
+
+  /*zlib header, same as lodepng_zlib_compress*/
+  if(!error) {
+    unsigned CMFFLG = 256 * 120 + 0 * 32 + 0 * 64;
+    CMFFLG += 31 - CMFFLG % 31;
+    if(!ucvector_resize(&e->compressed, 2)) error = 83; /*alloc fail*/
+    else {
+      e->compressed.data[0] = (unsigned char)(CMFFLG >> 8);
+      e->compressed.data[1] = (unsigned char)(CMFFLG & 255);
+    }
+  }
+
+  /*signature and the chunks before IDAT*/
+  if(!error) error = writeSignature(&header);
+  if(!error) error = addChunk_IHDR(&header, w, h, color->colortype, color->bitdepth, 0);
+  if(!error && color->colortype == LCT_PALETTE) error = addChunk_PLTE(&header, color);
+  if(!error && state->encoder.force_palette && color->palettesize &&
+     (color->colortype == LCT_RGB || color->colortype == LCT_RGBA)) {
+    error = addChunk_PLTE(&header, color);
+  }
+  if(!error) error = addChunk_tRNS(&header, color);
+  if(!error) error = streamEmit(e, &header);
+  lodepng_free(header.data);
+
+  e->error = error;
+  return error;
+}
+
+unsigned lodepng_stream_encoder_push_rows(LodePNGStreamEncoder* encoder, const unsigned char* rows,
+                                          unsigned numrows) {
+  size_t linebytes = encoder->linebytes;
+  /*filter at most about one deflate block of rows at a time, to bound the memory use*/
+  unsigned batch = (unsigned)(encoder->blocksize / (linebytes + 1u));
+  if(batch == 0) batch = 1;
+
+  if(encoder->error) return encoder->error;
+  if(numrows > encoder->h - encoder->y) return encoder->error = 110;
+
+  while(numrows != 0 && !encoder->error) {
+    unsigned n = numrows < batch ? numrows : batch;
+    const unsigned char* prevline = encoder->y ? encoder->prevline : 0;
+    size_t start = encoder->window.size;
+    unsigned char* out;
+    unsigned i;
+
+    if(!ucvector_resize(&encoder->window, start + n * (linebytes + 1u))) return encoder->error = 83;
+    out = encoder->window.data + start;
+
+    if(encoder->strategy == LFS_MINSUM || encoder->strategy == LFS_ENTROPY) {
+      unsigned char* attempt[5];
+      for(i = 0; i != 5; ++i) attempt[i] = encoder->attempts.data + i * linebytes;
+      filterAdaptive(out, rows, prevline, linebytes, encoder->bytewidth, n, encoder->strategy, attempt);
+    } else {
+      for(i = 0; i != n; ++i) {
+        unsigned char type = encoder->strategy == LFS_PREDEFINED ?
+                             encoder->settings.predefined_filters[encoder->y + i] : (unsigned char)encoder->strategy;
+        out[i * (linebytes + 1u)] = type; /*filter type byte*/
+        filterScanline(&out[i * (linebytes + 1u) + 1], &rows[i * linebytes], prevline,
+                       linebytes, encoder->bytewidth, type);
+        prevline = &rows[i * linebytes];
+      }
+    }
+    encoder->adler = update_adler32(encoder->adler, out, (unsigned)(n * (linebytes + 1u)));
+    lodepng_memcpy(encoder->prevline, &rows[(n - 1) * linebytes], linebytes);
+    encoder->y += n;
+    rows += n * linebytes;
+    numrows -= n;
+
+    /*deflate all full blocks, keeping at least one byte for the final block*/
+    while(!encoder->error && encoder->window.size - encoder->windowpos > encoder->blocksize) {
+      encoder->error = streamDeflate(encoder, encoder->windowpos + encoder->blocksize, 0);
+    }
+  }
+
+  return encoder->error;
+}
+
+unsigned lodepng_stream_encoder_finish(LodePNGStreamEncoder* encoder) {
+  ucvector* compressed = &encoder->compressed;
+  size_t pos;
+
+  if(encoder->error) return encoder->error;
+  if(encoder->y != encoder->h) return encoder->error = 110;
+
+  encoder->error = streamDeflate(encoder, encoder->window.size, 1);
+  if(encoder->error) return encoder->error;
+
+  /*the final block ends the deflate data, the rest of its last byte stays zero*/
+  pos = compressed->size;
+  if(!ucvector_resize(compressed, pos + 4)) return encoder->error = 83; /*alloc fail*/
+  lodepng_set32bitInt(&compressed->data[pos], encoder->adler);
+  encoder->error = streamEmitIDAT(encoder, 1);
+  if(encoder->error) return encoder->error;
+
+  encoder->chunk.size = 0;
+  encoder->error = addChunk_IEND(&encoder->chunk);
+  if(!encoder->error) encoder->error = streamEmit(encoder, &encoder->chunk);
+  return encoder->error;
+}
+
+void lodepng_stream_encoder_cleanup(LodePNGStreamEncoder* encoder) {
+  if(!encoder) return;
+  hash_cleanup(&encoder->hash);
+  lodepng_free(encoder->prevline);
+  lodepng_free(encoder->filters);
+  lodepng_free(encoder->attempts.data);
+  lodepng_free(encoder->window.data);
+  lodepng_free(encoder->compressed.data);
+  lodepng_free(encoder->chunk.data);
+  lodepng_free(encoder);
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsigned char* image,
                                unsigned w, unsigned h, LodePNGColorType colortype, unsigned bitdepth) {
   unsigned error;
@@ -6204,6 +7166,8 @@ const char* lodepng_error_text(unsigned code) {
     case 106: return "PNG file must have PLTE chunk if color type is palette";
     case 107: return "color convert from palette mode requested without setting the palette data in it";
     case 108: return "tried to add more than 256 values to a palette";
+    case 109: return "the streaming encoder does not support interlacing or LFS_BRUTE_FORCE";
+    case 110: return "the streaming encoder received more or fewer rows than the image height";
   }
   return "unknown error code";
 }
@@ -6220,10 +7184,31 @@ namespace lodepng {
 
 #ifdef LODEPNG_COMPILE_DISK
 unsigned load_file(std::vector<unsigned char>& buffer, const std::string& filename) {
-  long size = lodepng_filesize(filename.c_str());
-  if(size < 0) return 78;
-  buffer.resize((size_t)size);
-  return size == 0 ? 0 : lodepng_buffer_file(&buffer[0], (size_t)size, filename.c_str());
+  FILE* file = fopen(filename.c_str(), "rb");
+  if(!file) return 78;
+  long size = lodepng_filesize(file);
+  unsigned error = size < 0 ? 78 : 0;
+  if(!error) {
+    buffer.resize((size_t)size);
+    if(size != 0 && fread(&buffer[0], 1, (size_t)size, file) != (size_t)size) error = 78;
+  }
+  fclose(file);
+  return error;
+}
+
+MappedFile::MappedFile() {
+  data = 0;
+  size = 0;
+  mapped = 0;
+}
+
+MappedFile::~MappedFile() {
+  lodepng_unmap_file(this);
+}
+
+unsigned MappedFile::open(const std::string& filename) {
+  lodepng_unmap_file(this);
+  return lodepng_map_file(this, filename.c_str());
 }
 
 /*write given buffer to the file, overwriting the file, it doesn't append to it.*/
@@ -6337,12 +7322,12 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
 #ifdef LODEPNG_COMPILE_DISK
 unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h, const std::string& filename,
                 LodePNGColorType colortype, unsigned bitdepth) {
-  std::vector<unsigned char> buffer;
+  MappedFile file;
   /* safe output values in case error happens */
   w = h = 0;
-  unsigned error = load_file(buffer, filename);
+  unsigned error = file.open(filename);
   if(error) return error;
-  return decode(out, w, h, buffer, colortype, bitdepth);
+  return decode(out, w, h, file.data, file.size, colortype, bitdepth);
 }
 #endif /* LODEPNG_COMPILE_DECODER */
 #endif /* LODEPNG_COMPILE_DISK */
@@ -0,0 +1,412 @@
+// A rendering daemon: services send it barcodes to render over a Unix domain
+// socket instead of linking bargenlib and warming its caches themselves.
+//
+//     bargenlib_daemon [--socket PATH] [--threads N] [--batch N] [--cache-mb N] [--disk-cache DIR]
+//
+// Every message is a little-endian 32-bit length followed by that many bytes.
+// Requests carry:
+//
+//     u32 id, u8 encoding, u8 file type, u8 flags, u8 digit count, digits (one byte each)
+//
+// with the Encoding and FileType values of bargenlib.h. The flag NoCache (1)
+// renders without the render cache. Replies carry:
+//
+//     u32 id, u8 status, then the image file (status 0) or an error message (status 1)
+//
+// A client may send many requests without waiting; replies come back as they
+// are rendered, not necessarily in order, matched by id. A client that runs
+// too far ahead, with 1024 requests unanswered or 4 MiB of replies it has not
+// read, is not read from until it catches up. A client may shut down its
+// writing end after its last request and still read every reply; the
+// daemon closes the connection after the last one. A malformed frame closes
+// the connection.
+//
+// One thread reads all connections with epoll and queues the requests. Each
+// worker takes every queued request at once, up to --batch, renders them and
+// sends the replies of the batch with one write per connection. Rendering
+// keeps no state between calls besides the shared render cache, so a worker
+// only keeps its batch and reply buffers from one batch to the next.
+// SIGINT or SIGTERM stops the daemon and removes the socket.
+//
+// Linux only (epoll and signalfd). Build with:
+//
+//     g++ -O2 -Iinclude tools/bargenlib_daemon.cpp src/bargenlib.cpp src/lodepng.cpp -pthread -o bargenlib_daemon
+
+#include "bargenlib/bargenlib.h"
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+    const std::uint32_t MaxRequestSize = 8 + 255;
+    const unsigned char NoCache = 1;
+
+    // Backpressure: a connection is not read from while it has this many
+    // requests queued or rendering, or this many reply bytes unsent, until
+    // both fall to the resume marks.
+    const std::size_t MaxPendingRequests = 1024;
+    const std::size_t ResumePendingRequests = 512;
+    const std::size_t MaxPendingBytes = 4u << 20;
+    const std::size_t ResumePendingBytes = 1u << 20;
+
+    struct Options {
+        std::string socket = "/tmp/bargenlib.sock";
+        int threads = static_cast<int>(std::thread::hardware_concurrency());
+        int batch = 64;
+        std::size_t cacheMb = 64;
+        std::string diskCache;
+    };
+
+    // A client connection. Its socket is closed with the last reference, so
+    // a worker still replying to a closed connection never writes to a
+    // reused descriptor.
+    struct Connection {
+        int fd;
+        std::string in;                 // read, not yet framed
+        std::mutex mutex;               // guards the members below
+        std::string out;                // replies the socket did not take yet
+        std::size_t pending = 0;        // requests queued or rendering
+        std::uint32_t events = EPOLLIN; // the events epoll watches for
+        bool readClosed = false;        // the client shut down its writing end
+        bool closed = false;
+
+        // All replies to a read-closed connection are sent.
+        bool done() const { return readClosed && pending == 0 && out.empty(); }
+
+        explicit Connection(int fd) : fd(fd) {}
+        ~Connection() { close(fd); }
+    };
+
+    struct Request {
+        std::shared_ptr<Connection> connection;
+        std::uint32_t id;
+        bargenlib::Encoding codeType;
+        bargenlib::FileType fileType;
+        unsigned char flags;
+        std::vector<int> code;
+    };
+
+    int Epoll = -1;
+    std::mutex QueueMutex;
+    std::condition_variable QueueReady;
+    std::deque<Request> Queue;
+    bool Stopping = false;
+
+    std::uint32_t getU32(const char *p) {
+        const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+        return u[0] | (u[1] << 8) | (u[2] << 16) | (static_cast<std::uint32_t>(u[3]) << 24);
+    }
+
+    void putU32(std::string &out, std::uint32_t value) {
+        for (int i = 0; i < 4; i++) out += static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+
+    void appendReply(std::string &out, std::uint32_t id, unsigned char status, const void *data, std::size_t size) {
+        putU32(out, static_cast<std::uint32_t>(5 + size));
+        putU32(out, id);
+        out += static_cast<char>(status);
+        out.append(static_cast<const char *>(data), size);
+    }
+
+    // Updates the events epoll watches for, holding the connection's mutex:
+    // EPOLLIN unless the client shut down its end or is too far ahead, and
+    // EPOLLOUT while replies wait for room, or once the connection is done,
+    // so the epoll thread wakes up to close it.
+    void watch(Connection &connection) {
+        bool reading = connection.events & EPOLLIN;
+        if (reading) {
+            reading = connection.pending < MaxPendingRequests && connection.out.size() < MaxPendingBytes;
+        } else {
+            reading = connection.pending <= ResumePendingRequests && connection.out.size() <= ResumePendingBytes;
+        }
+        std::uint32_t events = 0;
+        if (reading && !connection.readClosed) events |= EPOLLIN;
+        if (!connection.out.empty() || connection.done()) events |= EPOLLOUT;
+        if (events == connection.events) return;
+        connection.events = events;
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = connection.fd;
+        epoll_ctl(Epoll, EPOLL_CTL_MOD, connection.fd, &event);
+    }
+
+    // Sends what the socket takes of connection.out, holding its mutex, then
+    // updates what epoll watches for.
+    void flush(Connection &connection) {
+        std::size_t sent = 0;
+        while (sent < connection.out.size()) {
+            ssize_t n = send(connection.fd, connection.out.data() + sent, connection.out.size() - sent,
+                    MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n < 0) {
+                connection.closed = true;
+                connection.out.clear();
+                return;
+            }
+            sent += static_cast<std::size_t>(n);
+        }
+        connection.out.erase(0, sent);
+        watch(connection);
+    }
+
+    void renderBatch(std::vector<Request> &batch, std::string &reply) {
+        for (std::size_t i = 0; i < batch.size(); i++) {
+            if (!batch[i].connection) continue;  // already sent with an earlier request's connection
+            std::shared_ptr<Connection> connection = batch[i].connection;
+            reply.clear();
+            std::size_t served = 0;
+            for (std::size_t j = i; j < batch.size(); j++) {
+                Request &request = batch[j];
+                if (request.connection != connection) continue;
+                served++;
+                try {
+                    std::vector<unsigned char> file;
+                    if (request.flags & NoCache) {
+                        file = bargenlib::encode(bargenlib::rasterize(request.code, request.codeType,
+                                request.fileType));
+                    } else {
+                        file = bargenlib::render(request.code, request.codeType, request.fileType);
+                    }
+                    appendReply(reply, request.id, 0, file.data(), file.size());
+                } catch (const std::exception &error) {
+                    appendReply(reply, request.id, 1, error.what(), std::strlen(error.what()));
+                }
+                request.connection.reset();
+            }
+            std::lock_guard<std::mutex> lock(connection->mutex);
+            connection->pending -= served;
+            if (connection->closed) continue;
+            bool idle = connection->out.empty();
+            connection->out += reply;
+            if (idle) flush(*connection);
+        }
+    }
+
+    void work(int batchSize) {
+        std::vector<Request> batch;
+        std::string reply;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(QueueMutex);
+                QueueReady.wait(lock, []() { return Stopping || !Queue.empty(); });
+                if (Queue.empty()) return;
+                while (!Queue.empty() && batch.size() < static_cast<std::size_t>(batchSize)) {
+                    batch.push_back(std::move(Queue.front()));
+                    Queue.pop_front();
+                }
+            }
+            renderBatch(batch, reply);
+            batch.clear();
+        }
+    }
+
+    // Frames the requests read so far. Returns false on a malformed frame.
+    bool parseRequests(const std::shared_ptr<Connection> &connection, std::vector<Request> &requests) {
+        std::string &in = connection->in;
+        std::size_t at = 0;
+        while (in.size() - at >= 4) {
+            std::uint32_t size = getU32(&in[at]);
+            if (size < 8 || size > MaxRequestSize) return false;
+            if (in.size() - at - 4 < size) break;
+            const char *body = &in[at + 4];
+            unsigned char digits = static_cast<unsigned char>(body[7]);
+            if (size != 8u + digits) return false;
+            Request request;
+            request.connection = connection;
+            request.id = getU32(body);
+            request.codeType = static_cast<bargenlib::Encoding>(static_cast<unsigned char>(body[4]));
+            request.fileType = static_cast<bargenlib::FileType>(static_cast<unsigned char>(body[5]));
+            request.flags = static_cast<unsigned char>(body[6]);
+            if (request.codeType > bargenlib::EAN_8 || request.fileType > bargenlib::PNG_A) return false;
+            for (unsigned char d = 0; d < digits; d++) request.code.push_back(static_cast<signed char>(body[8 + d]));
+            requests.push_back(std::move(request));
+            at += 4 + size;
+        }
+        in.erase(0, at);
+        return true;
+    }
+
+    int listenOn(const std::string &path) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) return -1;
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        unlink(path.c_str());
+        if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, 512) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    void addWatch(int fd) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(Epoll, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    void serve(int listener, int signals) {
+        std::unordered_map<int, std::shared_ptr<Connection>> connections;
+        std::vector<Request> requests;
+        epoll_event events[64];
+        char buffer[65536];
+        for (;;) {
+            int count = epoll_wait(Epoll, events, 64, -1);
+            if (count < 0 && errno == EINTR) continue;
+            if (count < 0) break;
+            for (int e = 0; e < count; e++) {
+                int fd = events[e].data.fd;
+                if (fd == signals) return;
+                if (fd == listener) {
+                    int client;
+                    while ((client = accept4(listener, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                        connections[client] = std::make_shared<Connection>(client);
+                        addWatch(client);
+                    }
+                    continue;
+                }
+                auto found = connections.find(fd);
+                if (found == connections.end()) continue;
+                std::shared_ptr<Connection> connection = found->second;
+                // EPOLLHUP means the client closed both ends, so nobody reads the replies.
+                bool open = !(events[e].events & (EPOLLHUP | EPOLLERR));
+                if (open && (events[e].events & EPOLLOUT)) {
+                    std::lock_guard<std::mutex> lock(connection->mutex);
+                    flush(*connection);
+                    open = !connection->closed && !connection->done();
+                }
+                if (open && (events[e].events & EPOLLIN)) {
+                    // One read per event, so a client can't get far past the
+                    // backpressure limits; epoll reports the rest again.
+                    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+                    if (n > 0) {
+                        connection->in.append(buffer, n);
+                        if (!parseRequests(connection, requests)) open = false;
+                    } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                        open = false;
+                    }
+                    std::lock_guard<std::mutex> lock(connection->mutex);
+                    connection->pending += requests.size();
+                    if (n == 0) {
+                        // End of input: the replies are still sent, then the connection is closed.
+                        connection->readClosed = true;
+                        connection->in.clear();
+                    }
+                    watch(*connection);
+                    if (connection->done()) open = false;
+                }
+                if (!requests.empty()) {
+                    {
+                        std::lock_guard<std::mutex> lock(QueueMutex);
+                        for (Request &request : requests) Queue.push_back(std::move(request));
+                    }
+                    QueueReady.notify_all();
+                    requests.clear();
+                }
+                if (!open) {
+                    // Queued requests are still rendered, but their replies are dropped.
+                    std::lock_guard<std::mutex> lock(connection->mutex);
+                    connection->closed = true;
+                    connection->out.clear();
+                    epoll_ctl(Epoll, EPOLL_CTL_DEL, fd, 0);
+                    connections.erase(fd);
+                }
+            }
+        }
+    }
+
+    Options parseOptions(int argc, char **argv) {
+        Options options;
+        for (int i = 1; i < argc; i++) {
+            bool hasValue = i + 1 < argc;
+            if (!std::strcmp(argv[i], "--socket") && hasValue) {
+                options.socket = argv[++i];
+            } else if (!std::strcmp(argv[i], "--threads") && hasValue) {
+                options.threads = std::atoi(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--batch") && hasValue) {
+                options.batch = std::atoi(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--cache-mb") && hasValue) {
+                options.cacheMb = std::strtoul(argv[++i], 0, 10);
+            } else if (!std::strcmp(argv[i], "--disk-cache") && hasValue) {
+                options.diskCache = argv[++i];
+            } else {
+                std::fprintf(stderr, "usage: %s [--socket PATH] [--threads N] [--batch N] [--cache-mb N] "
+                        "[--disk-cache DIR]\n", argv[0]);
+                std::exit(1);
+            }
+        }
+        if (options.threads < 1) options.threads = 1;
+        if (options.batch < 1) options.batch = 1;
+        return options;
+    }
+}
+
+int main(int argc, char **argv) {
+    Options options = parseOptions(argc, argv);
+    bargenlib::setCacheCapacity(options.cacheMb << 20);
+    if (!options.diskCache.empty() && !bargenlib::openDiskCache(options.diskCache)) {
+        std::fprintf(stderr, "could not open the disk cache in %s\n", options.diskCache.c_str());
+        return 1;
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, 0);  // before the workers start, so they inherit it
+    int signals = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    int listener = listenOn(options.socket);
+    if (listener < 0) {
+        std::fprintf(stderr, "could not listen on %s: %s\n", options.socket.c_str(), std::strerror(errno));
+        return 1;
+    }
+    Epoll = epoll_create1(EPOLL_CLOEXEC);
+    addWatch(listener);
+    addWatch(signals);
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < options.threads; t++) workers.emplace_back(work, options.batch);
+    std::fprintf(stderr, "listening on %s with %d threads\n", options.socket.c_str(), options.threads);
+    serve(listener, signals);
+
+    {
+        std::lock_guard<std::mutex> lock(QueueMutex);
+        Stopping = true;
+    }
+    QueueReady.notify_all();
+    for (std::thread &worker : workers) worker.join();
+    close(listener);
+    unlink(options.socket.c_str());
+    bargenlib::closeDiskCache();
+
+    bargenlib::CacheStats cache = bargenlib::cacheStats();
+    std::fprintf(stderr, "stopped; render cache hits %llu, misses %llu\n",
+            static_cast<unsigned long long>(cache.hits), static_cast<unsigned long long>(cache.misses));
+    return 0;
+}